@@ -0,0 +1,194 @@
+#include "AccessLog.hpp"
+#include "JsonUtils.hpp"
+#include <trantor/utils/Logger.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using namespace spartoi;
+using spartoi::internal::appendJsonString;
+
+static void copyTruncated(char* dst, size_t size, std::string_view str)
+{
+    size_t n = std::min(size - 1, str.size());
+    // Cut before the first byte of a UTF-8 sequence rather than in the middle of one. A valid sequence has at most 3
+    // continuation bytes
+    for(int i = 0; i < 3 && n > 0 && n < str.size() && (static_cast<unsigned char>(str[n]) & 0xc0) == 0x80; i++)
+        n--;
+    memcpy(dst, str.data(), n);
+    dst[n] = '\0';
+}
+
+static void formatRecord(std::string& out, const AccessLogRecord& record)
+{
+    char number[64];
+    snprintf(number, sizeof(number), "{\"time\":%lld.%06lld,\"peer\":", (long long)(record.timestamp / 1000000)
+        , (long long)(record.timestamp % 1000000));
+    out += number;
+    appendJsonString(out, record.peer.toIpPort());
+    out += ",\"host\":";
+    appendJsonString(out, record.host);
+    out += ",\"path\":";
+    appendJsonString(out, record.path);
+    snprintf(number, sizeof(number), ",\"upload\":%zu,\"status\":%d,\"sent\":%zu", record.uploadSize, record.status
+        , record.bytesSent);
+    out += number;
+    snprintf(number, sizeof(number), ",\"latency_us\":%lld}\n", (long long)record.latency);
+    out += number;
+}
+
+void AccessLogRecord::setHost(std::string_view str)
+{
+    copyTruncated(host, sizeof(host), str);
+}
+
+void AccessLogRecord::setPath(std::string_view str)
+{
+    copyTruncated(path, sizeof(path), str);
+}
+
+AccessLog::Producer::Producer(AccessLog& log)
+    : ring_(std::make_shared<Ring>(log.config_.ringSize)), log_(log)
+{
+    std::lock_guard lock(log.ringsMutex_);
+    log.rings_.push_back(ring_);
+}
+
+void AccessLog::Producer::push(const AccessLogRecord& record)
+{
+    if(!ring_->push(record))
+        log_.dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+AccessLog::AccessLog(const AccessLogConfig& config)
+    : config_(config)
+{
+    if(config_.path.empty())
+        throw std::invalid_argument("Access log path must not be empty");
+}
+
+AccessLog::~AccessLog()
+{
+    stop();
+}
+
+void AccessLog::start()
+{
+    std::lock_guard lock(mutex_);
+    if(running_)
+        return;
+    openFile();
+    running_ = true;
+    thread_ = std::thread([this]() { run(); });
+}
+
+void AccessLog::stop()
+{
+    {
+        std::lock_guard lock(mutex_);
+        if(!running_)
+            return;
+        running_ = false;
+    }
+    cv_.notify_all();
+    thread_.join();
+    if(file_ != nullptr)
+    {
+        std::fclose(file_);
+        file_ = nullptr;
+    }
+}
+
+void AccessLog::run()
+{
+    std::string buffer;
+    const auto interval = std::chrono::duration<double>(config_.flushInterval);
+    bool running = true;
+    while(running)
+    {
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait_for(lock, interval, [this]() { return !running_; });
+            running = running_;
+        }
+
+        // Keep going until the rings are empty, so a final stop() doesn't lose anything
+        while(drainRings(buffer) != 0)
+        {
+            writeBuffer(buffer);
+            buffer.clear();
+        }
+        if(file_ != nullptr)
+            std::fflush(file_);
+
+        uint64_t dropped = droppedRecords();
+        if(dropped != reportedDropped_)
+        {
+            LOG_WARN << "Access log dropped " << dropped - reportedDropped_ << " records. The IO threads are "
+                "producing faster than the log can be written. Consider a larger ringSize";
+            reportedDropped_ = dropped;
+        }
+    }
+}
+
+size_t AccessLog::drainRings(std::string& buffer)
+{
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard lock(ringsMutex_);
+        rings = rings_;
+    }
+
+    size_t count = 0;
+    for(const auto& ring : rings)
+        count += ring->drain([&buffer](const AccessLogRecord& record) { formatRecord(buffer, record); });
+    return count;
+}
+
+void AccessLog::writeBuffer(const std::string& buffer)
+{
+    if(file_ == nullptr)
+        return;
+    if(std::fwrite(buffer.data(), 1, buffer.size(), file_) != buffer.size())
+        LOG_ERROR << "Failed to write access log " << config_.path << ": " << strerror(errno);
+    fileSize_ += buffer.size();
+    if(config_.maxFileSize != 0 && fileSize_ >= config_.maxFileSize)
+        rotate();
+}
+
+void AccessLog::openFile()
+{
+    file_ = std::fopen(config_.path.c_str(), "a");
+    if(file_ == nullptr)
+    {
+        LOG_ERROR << "Failed to open access log " << config_.path << ": " << strerror(errno);
+        return;
+    }
+    // We batch writes ourselves. A large stdio buffer keeps the number of write(2) calls down further
+    std::setvbuf(file_, nullptr, _IOFBF, 256 * 1024);
+    std::fseek(file_, 0, SEEK_END);
+    long pos = std::ftell(file_);
+    fileSize_ = pos > 0 ? pos : 0;
+}
+
+void AccessLog::rotate()
+{
+    std::fclose(file_);
+    file_ = nullptr;
+    if(config_.maxFiles == 0)
+        std::remove(config_.path.c_str());
+    else
+    {
+        for(size_t i = config_.maxFiles - 1; i > 0; i--)
+        {
+            std::string from = config_.path + "." + std::to_string(i);
+            std::string to = config_.path + "." + std::to_string(i + 1);
+            std::rename(from.c_str(), to.c_str());
+        }
+        std::rename(config_.path.c_str(), (config_.path + ".1").c_str());
+    }
+    openFile();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "SpscRing.hpp"
+#include <trantor/net/InetAddress.h>
+#include <trantor/utils/NonCopyable.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace spartoi
+{
+
+struct AccessLogConfig
+{
+    std::string path;
+    // Rotate the file once it grows beyond this many bytes. 0 disables rotation
+    size_t maxFileSize = 64 * 1024 * 1024;
+    // Number of rotated files (path.1, path.2, ...) to keep
+    size_t maxFiles = 5;
+    // Records each IO loop can queue before new ones are dropped
+    size_t ringSize = 4096;
+    // How often the background thread wakes up to write queued records, in seconds
+    double flushInterval = 0.2;
+};
+
+/**
+ * @brief A single request as recorded by the server. Fixed size so queuing it never allocates on the IO thread.
+ *        Host and path are truncated if too long.
+ */
+struct AccessLogRecord
+{
+    int64_t timestamp = 0; // microseconds since epoch
+    int64_t latency = 0; // microseconds from accept to close
+    trantor::InetAddress peer;
+    size_t uploadSize = 0;
+    size_t bytesSent = 0;
+    int status = 0;
+    char host[64] = {};
+    char path[160] = {};
+
+    void setHost(std::string_view str);
+    void setPath(std::string_view str);
+};
+
+/**
+ * @brief Structured (JSON lines) access log. IO loops queue records into their own lock-free ring through a
+ *        Producer. A background thread drains all rings in batches into the log file. Records are dropped and
+ *        counted instead of blocking when a ring is full.
+ */
+class AccessLog : public trantor::NonCopyable
+{
+    using Ring = SpscRing<AccessLogRecord>;
+
+public:
+    explicit AccessLog(const AccessLogConfig& config);
+    ~AccessLog();
+
+    void start();
+    /**
+     * @brief Stop the background thread after writing every queued record.
+     */
+    void stop();
+
+    /**
+     * @brief Producing end of the log. Create one per IO loop and only use it from that loop.
+     */
+    class Producer
+    {
+    public:
+        explicit Producer(AccessLog& log);
+        void push(const AccessLogRecord& record);
+
+    protected:
+        std::shared_ptr<Ring> ring_;
+        AccessLog& log_;
+    };
+
+    uint64_t droppedRecords() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+protected:
+    void run();
+    size_t drainRings(std::string& buffer);
+    void writeBuffer(const std::string& buffer);
+    void openFile();
+    void rotate();
+
+    AccessLogConfig config_;
+    std::FILE* file_ = nullptr;
+    size_t fileSize_ = 0;
+
+    std::mutex ringsMutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t reportedDropped_ = 0;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = false;
+};
+
+}
@@ -0,0 +1,233 @@
+#include "IoUring.hpp"
+#include <trantor/utils/Logger.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace spartoi;
+
+static std::runtime_error systemError(const std::string& what)
+{
+    return std::runtime_error(what + ": " + strerror(errno));
+}
+
+template <typename T>
+static T* at(void* base, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+IoUring::IoUring(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Multishot receives can post many completions per submission. Make room for them
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if(fd_ < 0)
+        throw systemError("io_uring_setup");
+
+    if(!(params.features & IORING_FEAT_NODROP))
+    {
+        ::close(fd_);
+        throw std::runtime_error("io_uring is too old (no IORING_FEAT_NODROP)");
+    }
+
+    sqEntries_ = params.sq_entries;
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(singleMmap)
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if(sqRing_ == MAP_FAILED)
+    {
+        sqRing_ = nullptr;
+        auto err = systemError("mmap io_uring SQ");
+        release();
+        throw err;
+    }
+    if(singleMmap)
+        cqRing_ = sqRing_;
+    else
+    {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_
+            , IORING_OFF_CQ_RING);
+        if(cqRing_ == MAP_FAILED)
+        {
+            cqRing_ = nullptr;
+            auto err = systemError("mmap io_uring CQ");
+            release();
+            throw err;
+        }
+    }
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+    {
+        auto err = systemError("mmap io_uring SQEs");
+        release();
+        throw err;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    sqHead_ = at<unsigned>(sqRing_, params.sq_off.head);
+    sqTail_ = at<unsigned>(sqRing_, params.sq_off.tail);
+    sqFlags_ = at<unsigned>(sqRing_, params.sq_off.flags);
+    sqMask_ = *at<unsigned>(sqRing_, params.sq_off.ring_mask);
+    sqeTail_ = *sqTail_;
+    // SQE i always sits in slot i, so the indirection array is filled once
+    unsigned* array = at<unsigned>(sqRing_, params.sq_off.array);
+    for(unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    cqHead_ = at<unsigned>(cqRing_, params.cq_off.head);
+    cqTail_ = at<unsigned>(cqRing_, params.cq_off.tail);
+    cqMask_ = *at<unsigned>(cqRing_, params.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cqRing_, params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+    release();
+}
+
+void IoUring::release()
+{
+    if(bufRing_ != nullptr)
+        munmap(bufRing_, bufRingSize_);
+    delete[] buffers_;
+    if(sqes_ != nullptr)
+        munmap(sqes_, sqesSize_);
+    if(cqRing_ != nullptr && cqRing_ != sqRing_)
+        munmap(cqRing_, cqRingSize_);
+    if(sqRing_ != nullptr)
+        munmap(sqRing_, sqRingSize_);
+    if(fd_ >= 0)
+        ::close(fd_);
+    bufRing_ = nullptr;
+    buffers_ = nullptr;
+    sqes_ = nullptr;
+    cqRing_ = sqRing_ = nullptr;
+    fd_ = -1;
+}
+
+int IoUring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd_, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+io_uring_sqe* IoUring::getSqe()
+{
+    if(sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_)
+        submit();
+    if(sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_)
+        return nullptr;
+    io_uring_sqe* sqe = &sqes_[sqeTail_ & sqMask_];
+    sqeTail_++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+size_t IoUring::pendingSubmissions() const
+{
+    return sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+}
+
+void IoUring::submit()
+{
+    __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+    unsigned toSubmit = pendingSubmissions();
+    while(toSubmit != 0)
+    {
+        int ret = enter(toSubmit, 0, 0);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            // EBUSY/EAGAIN: the completion queue is backed up. Whatever is left goes with the next submit()
+            if(errno != EBUSY && errno != EAGAIN)
+                LOG_ERROR << "io_uring_enter failed: " << strerror(errno);
+            return;
+        }
+        if(ret == 0)
+            return;
+        toSubmit -= std::min<unsigned>(ret, toSubmit);
+    }
+}
+
+bool IoUring::flushOverflow()
+{
+    if(!(__atomic_load_n(sqFlags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+        return false;
+    return enter(0, 0, IORING_ENTER_GETEVENTS) >= 0;
+}
+
+void IoUring::registerEventFd(int fd)
+{
+    if(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &fd, 1) < 0)
+        throw systemError("io_uring_register(EVENTFD)");
+}
+
+void IoUring::setupBufferRing(uint16_t groupId, unsigned count, unsigned size)
+{
+    if(count == 0 || (count & (count - 1)) != 0 || count > 32768)
+        throw std::invalid_argument("Buffer ring size must be a power of 2 up to 32768");
+
+    bufRingSize_ = count * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, bufRingSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED)
+        throw systemError("mmap buffer ring");
+    // Touch the pages before the kernel pins them. Otherwise it may pin the shared zero page and never see our writes
+    memset(ring, 0, bufRingSize_);
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = groupId;
+    if(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        auto err = systemError("io_uring_register(PBUF_RING)");
+        munmap(ring, bufRingSize_);
+        throw err;
+    }
+
+    bufRing_ = static_cast<io_uring_buf_ring*>(ring);
+    bufferCount_ = count;
+    bufferSize_ = size;
+    bufGroup_ = groupId;
+    buffers_ = new char[size_t(count) * size];
+    for(unsigned i = 0; i < count; i++)
+    {
+        io_uring_buf& buf = ringEntry(i);
+        buf.addr = reinterpret_cast<uint64_t>(buffer(i));
+        buf.len = size;
+        buf.bid = i;
+    }
+    __atomic_store_n(&bufRing_->tail, uint16_t(count), __ATOMIC_RELEASE);
+}
+
+io_uring_buf& IoUring::ringEntry(unsigned index)
+{
+    // Not bufRing_->bufs: in C++ the kernel header's flexible array member lands at offset 8 instead of 0
+    return reinterpret_cast<io_uring_buf*>(bufRing_)[index];
+}
+
+void IoUring::recycleBuffer(uint16_t bid)
+{
+    uint16_t tail = bufRing_->tail;
+    io_uring_buf& buf = ringEntry(tail & (bufferCount_ - 1));
+    buf.addr = reinterpret_cast<uint64_t>(buffer(bid));
+    buf.len = bufferSize_;
+    buf.bid = bid;
+    __atomic_store_n(&bufRing_->tail, uint16_t(tail + 1), __ATOMIC_RELEASE);
+}
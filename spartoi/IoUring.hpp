@@ -0,0 +1,141 @@
+#pragma once
+
+#include <trantor/utils/NonCopyable.h>
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace spartoi
+{
+
+/**
+ * @brief Minimal io_uring instance talking to the kernel directly, so the optional transport needs nothing beyond
+ *        the kernel headers. Not thread safe, meant to be owned and driven by a single event loop.
+ *
+ *        Besides the submission and completion queues it can hold one provided buffer ring, the kernel picks
+ *        buffers from it for receives submitted with IOSQE_BUFFER_SELECT.
+ */
+class IoUring : public trantor::NonCopyable
+{
+public:
+    /**
+     * @brief Throws std::runtime_error if io_uring is unavailable (old kernel, disabled by sysctl or seccomp).
+     */
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    /**
+     * @brief A zeroed submission entry. Submits what is queued first if the queue is full.
+     */
+    io_uring_sqe* getSqe();
+
+    /**
+     * @brief Hand every queued entry to the kernel with a single syscall.
+     */
+    void submit();
+
+    size_t pendingSubmissions() const;
+
+    /**
+     * @brief Entries getSqe() can hand out before it has to submit. Linked entries must go out in the same submit.
+     */
+    size_t spaceLeft() const
+    {
+        return sqEntries_ - pendingSubmissions();
+    }
+
+    /**
+     * @brief Call func(const io_uring_cqe&) for every available completion. The completion slot is already released
+     *        when func runs, so func may queue more work.
+     */
+    template <typename Func>
+    size_t forEachCompletion(Func&& func)
+    {
+        size_t count = 0;
+        for(;;)
+        {
+            unsigned head = __atomic_load_n(cqHead_, __ATOMIC_RELAXED);
+            unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            if(head == tail)
+            {
+                // Completions that didn't fit the queue are held by the kernel until asked for
+                if(!flushOverflow())
+                    break;
+                continue;
+            }
+            for(; head != tail; head++)
+            {
+                io_uring_cqe cqe = cqes_[head & cqMask_];
+                __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+                func(cqe);
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * @brief Signal fd (an eventfd) whenever a completion is posted. Lets a poll based loop wait on the ring.
+     */
+    void registerEventFd(int fd);
+
+    /**
+     * @brief Register count buffers of size bytes as buffer group groupId. count must be a power of 2.
+     *        Throws std::runtime_error if the kernel doesn't support buffer rings (before 5.19).
+     */
+    void setupBufferRing(uint16_t groupId, unsigned count, unsigned size);
+
+    char* buffer(uint16_t bid) const
+    {
+        return buffers_ + size_t(bid) * bufferSize_;
+    }
+
+    /**
+     * @brief Give a buffer the kernel selected back to the ring once it's contents are consumed.
+     */
+    void recycleBuffer(uint16_t bid);
+
+    int fd() const
+    {
+        return fd_;
+    }
+
+protected:
+    void release();
+    io_uring_buf& ringEntry(unsigned index);
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    bool flushOverflow();
+
+    int fd_ = -1;
+    unsigned sqEntries_ = 0;
+
+    void* sqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    void* cqRing_ = nullptr;
+    size_t cqRingSize_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqFlags_ = nullptr;
+    unsigned sqMask_ = 0;
+    // Entries handed out by getSqe(), published to the kernel by submit()
+    unsigned sqeTail_ = 0;
+
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    io_uring_buf_ring* bufRing_ = nullptr;
+    size_t bufRingSize_ = 0;
+    char* buffers_ = nullptr;
+    unsigned bufferCount_ = 0;
+    unsigned bufferSize_ = 0;
+    uint16_t bufGroup_ = 0;
+};
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+namespace spartoi
+{
+
+namespace internal
+{
+
+/**
+ * @brief Length of the valid UTF-8 sequence at the start of str, 0 if it doesn't start with one. Overlong encodings,
+ *        surrogates and code points past U+10FFFF are invalid.
+ */
+inline size_t utf8SequenceLength(std::string_view str)
+{
+    const auto byte = [&str](size_t i) { return static_cast<unsigned char>(str[i]); };
+    unsigned char first = byte(0);
+    size_t length;
+    unsigned char min = 0x80, max = 0xbf;
+    if(first < 0x80)
+        return 1;
+    else if(first >= 0xc2 && first <= 0xdf)
+        length = 2;
+    else if(first >= 0xe0 && first <= 0xef)
+    {
+        length = 3;
+        if(first == 0xe0)
+            min = 0xa0;
+        else if(first == 0xed)
+            max = 0x9f;
+    }
+    else if(first >= 0xf0 && first <= 0xf4)
+    {
+        length = 4;
+        if(first == 0xf0)
+            min = 0x90;
+        else if(first == 0xf4)
+            max = 0x8f;
+    }
+    else
+        return 0;
+    if(str.size() < length || byte(1) < min || byte(1) > max)
+        return 0;
+    for(size_t i = 2; i < length; i++)
+    {
+        if(byte(i) < 0x80 || byte(i) > 0xbf)
+            return 0;
+    }
+    return length;
+}
+
+/**
+ * @brief Append str to out as a quoted JSON string. Used by the writers that produce JSON by hand (the access log and
+ *        the trace dump), they only need escaping and nothing else of a JSON library.
+ *
+ *        str may hold any bytes from the wire. Valid UTF-8 is copied as is, every byte that isn't part of a valid
+ *        sequence is written as \u00XX so the output stays valid JSON.
+ */
+inline void appendJsonString(std::string& out, std::string_view str)
+{
+    out += '"';
+    size_t i = 0;
+    while(i < str.size())
+    {
+        char c = str[i];
+        if(c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+            i++;
+            continue;
+        }
+        size_t length = utf8SequenceLength(str.substr(i));
+        if(length == 0 || static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+            out += escaped;
+            i++;
+            continue;
+        }
+        out.append(str.data() + i, length);
+        i += length;
+    }
+    out += '"';
+}
+
+}
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <trantor/net/EventLoop.h>
+#include <trantor/utils/NonCopyable.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace spartoi
+{
+
+/**
+ * @brief One instance of T per event loop. The set of loops is fixed by init() before the loops start serving
+ *        requests, so lookups never take a lock. Each instance must only be touched from it's own loop thread.
+ */
+template <typename T>
+class LoopStorage : public trantor::NonCopyable
+{
+public:
+    template <typename... Args>
+    void init(const std::vector<trantor::EventLoop*>& loops, Args&&... args)
+    {
+        slots_.clear();
+        slots_.reserve(loops.size());
+        for(auto loop : loops)
+            slots_.emplace_back(loop, std::make_shared<T>(args...));
+    }
+
+    /**
+     * @brief Get the instance owned by loop. Returns nullptr if the storage is not initialized or the loop is unknown.
+     */
+    T* get(const trantor::EventLoop* loop) const
+    {
+        // There's only a handful of IO loops. A linear scan beats hashing here
+        for(const auto& [l, value] : slots_)
+        {
+            if(l == loop)
+                return value.get();
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Shared ownership of the instance owned by loop. For callbacks on that loop that may outlive the storage.
+     */
+    std::shared_ptr<T> share(const trantor::EventLoop* loop) const
+    {
+        for(const auto& [l, value] : slots_)
+        {
+            if(l == loop)
+                return value;
+        }
+        return nullptr;
+    }
+
+    template <typename Func>
+    void forEach(Func&& func) const
+    {
+        for(const auto& [loop, value] : slots_)
+            func(loop, *value);
+    }
+
+    bool empty() const
+    {
+        return slots_.empty();
+    }
+
+protected:
+    std::vector<std::pair<trantor::EventLoop*, std::shared_ptr<T>>> slots_;
+};
+
+}
@@ -0,0 +1,286 @@
+#include "LoopbackConnection.hpp"
+#include <trantor/utils/Logger.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+using namespace spartoi;
+using namespace trantor;
+
+LoopbackConnection::LoopbackConnection(EventLoop* loop, const InetAddress& localAddr, const InetAddress& peerAddr)
+    : loop_(loop), localAddr_(localAddr), peerAddr_(peerAddr)
+{
+}
+
+std::pair<LoopbackConnection::Ptr, LoopbackConnection::Ptr> LoopbackConnection::createPair(EventLoop* firstLoop
+    , const InetAddress& firstAddr, EventLoop* secondLoop, const InetAddress& secondAddr)
+{
+    auto first = std::make_shared<LoopbackConnection>(firstLoop, firstAddr, secondAddr);
+    auto second = std::make_shared<LoopbackConnection>(secondLoop, secondAddr, firstAddr);
+    first->peer_ = second;
+    second->peer_ = first;
+    return {first, second};
+}
+
+void LoopbackConnection::connectEstablished()
+{
+    loop_->runInLoop([thisPtr = shared_from_this()]() {
+        if(thisPtr->status_ != Status::Connecting)
+            return;
+        thisPtr->status_ = Status::Connected;
+        thisPtr->self_ = thisPtr;
+        if(thisPtr->connCallback_)
+            thisPtr->connCallback_(thisPtr);
+
+        auto pending = std::move(thisPtr->pending_);
+        for(auto& data : pending)
+            thisPtr->receive(std::move(data));
+    });
+}
+
+void LoopbackConnection::send(const char* msg, size_t len)
+{
+    send(std::string(msg, len));
+}
+
+void LoopbackConnection::send(const void* msg, size_t len)
+{
+    send(std::string(static_cast<const char*>(msg), len));
+}
+
+void LoopbackConnection::send(const std::string& msg)
+{
+    send(std::string(msg));
+}
+
+void LoopbackConnection::send(std::string&& msg)
+{
+    if(loop_->isInLoopThread())
+    {
+        sendInLoop(std::move(msg));
+        return;
+    }
+    loop_->queueInLoop([thisPtr = shared_from_this(), msg = std::move(msg)]() mutable {
+        thisPtr->sendInLoop(std::move(msg));
+    });
+}
+
+void LoopbackConnection::send(const MsgBuffer& buffer)
+{
+    send(std::string(buffer.peek(), buffer.readableBytes()));
+}
+
+void LoopbackConnection::send(MsgBuffer&& buffer)
+{
+    send(std::string(buffer.peek(), buffer.readableBytes()));
+}
+
+void LoopbackConnection::send(const std::shared_ptr<std::string>& msgPtr)
+{
+    send(*msgPtr);
+}
+
+void LoopbackConnection::send(const std::shared_ptr<MsgBuffer>& msgPtr)
+{
+    send(*msgPtr);
+}
+
+static std::string readFileRange(const std::filesystem::path& path, long long offset, long long length)
+{
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+    {
+        LOG_ERROR << "Loopback connection can't open " << path.string();
+        return {};
+    }
+    in.seekg(offset);
+    if(length <= 0)
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    std::string data(length, '\0');
+    in.read(data.data(), length);
+    data.resize(in.gcount());
+    return data;
+}
+
+void LoopbackConnection::sendFile(const char* fileName, long long offset, long long length)
+{
+    send(readFileRange(fileName, offset, length));
+}
+
+void LoopbackConnection::sendFile(const wchar_t* fileName, long long offset, long long length)
+{
+    send(readFileRange(fileName, offset, length));
+}
+
+void LoopbackConnection::sendStream(std::function<std::size_t(char*, std::size_t)> callback)
+{
+    char buffer[16 * 1024];
+    for(size_t n = callback(buffer, sizeof(buffer)); n != 0; n = callback(buffer, sizeof(buffer)))
+        send(buffer, n);
+    // Tell the stream we are done, same as trantor
+    callback(nullptr, 0);
+}
+
+void LoopbackConnection::sendInLoop(std::string&& data)
+{
+    if(status_ != Status::Connected)
+    {
+        LOG_DEBUG << "Loopback connection is not connected. Dropping " << data.size() << " bytes";
+        return;
+    }
+    auto peer = peer_.lock();
+    if(!peer)
+        return;
+    bytesSent_ += data.size();
+    // Always queue, never call into the peer directly. Otherwise a response could be handled while the code sending
+    // it is still on the stack, which never happens with real sockets
+    peer->loop_->queueInLoop([peer, data = std::move(data)]() mutable {
+        peer->receive(std::move(data));
+    });
+}
+
+void LoopbackConnection::receive(std::string&& data)
+{
+    if(status_ == Status::Connecting)
+    {
+        pending_.push_back(std::move(data));
+        return;
+    }
+    if(status_ == Status::Disconnected)
+        return;
+    bytesReceived_ += data.size();
+    recvBuffer_.append(data.data(), data.size());
+    if(messageCallback_)
+        messageCallback_(shared_from_this(), &recvBuffer_);
+}
+
+void LoopbackConnection::handlePeerShutdown()
+{
+    // Like reading EOF from a socket
+    handleClose();
+}
+
+void LoopbackConnection::handleClose()
+{
+    if(status_ == Status::Disconnected)
+        return;
+    status_ = Status::Disconnected;
+    auto thisPtr = shared_from_this();
+    if(connCallback_)
+        connCallback_(thisPtr);
+
+    if(auto peer = peer_.lock())
+    {
+        peer->loop_->queueInLoop([peer]() {
+            peer->handleClose();
+        });
+    }
+    self_.reset();
+}
+
+void LoopbackConnection::shutdown()
+{
+    loop_->runInLoop([thisPtr = shared_from_this()]() {
+        if(thisPtr->status_ != Status::Connected)
+            return;
+        thisPtr->status_ = Status::Disconnecting;
+        auto peer = thisPtr->peer_.lock();
+        if(!peer)
+            return;
+        // Queued behind everything we sent so far
+        peer->loop_->queueInLoop([peer]() {
+            peer->handlePeerShutdown();
+        });
+    });
+}
+
+void LoopbackConnection::forceClose()
+{
+    loop_->runInLoop([thisPtr = shared_from_this()]() {
+        thisPtr->handleClose();
+    });
+}
+
+const InetAddress& LoopbackConnection::localAddr() const
+{
+    return localAddr_;
+}
+
+const InetAddress& LoopbackConnection::peerAddr() const
+{
+    return peerAddr_;
+}
+
+bool LoopbackConnection::connected() const
+{
+    return status_ == Status::Connected;
+}
+
+bool LoopbackConnection::disconnected() const
+{
+    return status_ == Status::Disconnected;
+}
+
+MsgBuffer* LoopbackConnection::getRecvBuffer()
+{
+    return &recvBuffer_;
+}
+
+void LoopbackConnection::setHighWaterMarkCallback(const HighWaterMarkCallback&, size_t)
+{
+    // Nothing is ever buffered on the sending side
+}
+
+void LoopbackConnection::setTcpNoDelay(bool)
+{
+}
+
+EventLoop* LoopbackConnection::getLoop()
+{
+    return loop_;
+}
+
+void LoopbackConnection::keepAlive()
+{
+}
+
+bool LoopbackConnection::isKeepAlive()
+{
+    return false;
+}
+
+size_t LoopbackConnection::bytesSent() const
+{
+    return bytesSent_;
+}
+
+size_t LoopbackConnection::bytesReceived() const
+{
+    return bytesReceived_;
+}
+
+bool LoopbackConnection::isSSLConnection() const
+{
+    return false;
+}
+
+void LoopbackConnection::startEncryption(TLSPolicyPtr, bool, std::function<void(const TcpConnectionPtr&)>)
+{
+    LOG_ERROR << "Loopback connections don't support TLS";
+}
+
+std::string LoopbackConnection::applicationProtocol() const
+{
+    return "";
+}
+
+CertificatePtr LoopbackConnection::peerCertificate() const
+{
+    return nullptr;
+}
+
+std::string LoopbackConnection::sniName() const
+{
+    return "";
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <trantor/net/EventLoop.h>
+#include <trantor/net/Certificate.h>
+#include <trantor/net/InetAddress.h>
+#include <trantor/net/TLSPolicy.h>
+#include <trantor/net/TcpConnection.h>
+#include <trantor/net/callbacks.h>
+#include <trantor/utils/MsgBuffer.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace spartoi
+{
+
+/**
+ * @brief One end of an in-memory duplex connection. Behaves like a trantor TCP connection (sends arrive in order on
+ *        the peer's loop, shutdown() is seen as EOF by the peer, both ends get a disconnect callback) but never
+ *        touches the kernel. Used to pair SpartanClient with SpartanServer in the same process.
+ *
+ *        Implements the TcpConnection interface of trantor 1.5 (the one with TLSPolicy based encryption).
+ */
+class LoopbackConnection : public trantor::TcpConnection
+    , public std::enable_shared_from_this<LoopbackConnection>
+{
+public:
+    using Ptr = std::shared_ptr<LoopbackConnection>;
+
+    /**
+     * @brief Create two connected ends. Nothing is delivered until both ends are established.
+     */
+    static std::pair<Ptr, Ptr> createPair(trantor::EventLoop* firstLoop, const trantor::InetAddress& firstAddr
+        , trantor::EventLoop* secondLoop, const trantor::InetAddress& secondAddr);
+
+    void setMessageCallback(trantor::RecvMessageCallback cb)
+    {
+        messageCallback_ = std::move(cb);
+    }
+    void setConnectionCallback(trantor::ConnectionCallback cb)
+    {
+        connCallback_ = std::move(cb);
+    }
+
+    /**
+     * @brief Mark this end connected and invoke the connection callback on it's loop. The connection keeps itself
+     *        alive until it's closed, just like connections owned by a TcpServer.
+     */
+    void connectEstablished();
+
+    void send(const char* msg, size_t len) override;
+    void send(const void* msg, size_t len) override;
+    void send(const std::string& msg) override;
+    void send(std::string&& msg) override;
+    void send(const trantor::MsgBuffer& buffer) override;
+    void send(trantor::MsgBuffer&& buffer) override;
+    void send(const std::shared_ptr<std::string>& msgPtr) override;
+    void send(const std::shared_ptr<trantor::MsgBuffer>& msgPtr) override;
+    void sendFile(const char* fileName, long long offset = 0, long long length = 0) override;
+    void sendFile(const wchar_t* fileName, long long offset = 0, long long length = 0) override;
+    void sendStream(std::function<std::size_t(char*, std::size_t)> callback) override;
+    const trantor::InetAddress& localAddr() const override;
+    const trantor::InetAddress& peerAddr() const override;
+    bool connected() const override;
+    bool disconnected() const override;
+    trantor::MsgBuffer* getRecvBuffer() override;
+    void setHighWaterMarkCallback(const trantor::HighWaterMarkCallback& cb, size_t markLen) override;
+    void setTcpNoDelay(bool on) override;
+    void shutdown() override;
+    void forceClose() override;
+    trantor::EventLoop* getLoop() override;
+    void keepAlive() override;
+    bool isKeepAlive() override;
+    size_t bytesSent() const override;
+    size_t bytesReceived() const override;
+    bool isSSLConnection() const override;
+    void startEncryption(trantor::TLSPolicyPtr policy, bool isServer
+        , std::function<void(const trantor::TcpConnectionPtr&)> upgradeCallback = nullptr) override;
+    std::string applicationProtocol() const override;
+    trantor::CertificatePtr peerCertificate() const override;
+    std::string sniName() const override;
+
+    LoopbackConnection(trantor::EventLoop* loop, const trantor::InetAddress& localAddr
+        , const trantor::InetAddress& peerAddr);
+
+protected:
+    enum class Status
+    {
+        Connecting,
+        Connected,
+        Disconnecting,
+        Disconnected
+    };
+
+    void sendInLoop(std::string&& data);
+    void receive(std::string&& data);
+    void handlePeerShutdown();
+    void handleClose();
+
+    trantor::EventLoop* loop_;
+    trantor::InetAddress localAddr_;
+    trantor::InetAddress peerAddr_;
+    std::weak_ptr<LoopbackConnection> peer_;
+    std::shared_ptr<LoopbackConnection> self_;
+    Status status_ = Status::Connecting;
+    // Data the peer sent before this end was established
+    std::vector<std::string> pending_;
+    trantor::MsgBuffer recvBuffer_;
+    size_t bytesSent_ = 0;
+    size_t bytesReceived_ = 0;
+    // Not named like the callbacks TcpConnection itself keeps, those are only invoked by trantor's own connections
+    trantor::RecvMessageCallback messageCallback_;
+    trantor::ConnectionCallback connCallback_;
+};
+
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <trantor/utils/NonCopyable.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+
+namespace spartoi
+{
+
+struct PoolStats
+{
+    // Blocks that had to come from the system allocator
+    uint64_t freshAllocations = 0;
+    // Blocks handed out from the freelist
+    uint64_t reusedAllocations = 0;
+    // Blocks returned by threads other than the owner
+    uint64_t remoteFrees = 0;
+
+    PoolStats& operator+=(const PoolStats& other)
+    {
+        freshAllocations += other.freshAllocations;
+        reusedAllocations += other.reusedAllocations;
+        remoteFrees += other.remoteFrees;
+        return *this;
+    }
+};
+
+/**
+ * @brief Freelist of fixed size memory blocks owned by a single thread (the first one that allocates from it).
+ *        The owner allocates and frees without any atomic read-modify-write. Other threads return blocks through a
+ *        lock-free stack that the owner takes over in one go once it's own freelist runs dry.
+ */
+class BlockPool : public trantor::NonCopyable
+{
+public:
+    BlockPool(size_t blockSize, size_t maxCached)
+        : blockSize_(std::max(blockSize, sizeof(Node))), maxCached_(maxCached)
+    {
+    }
+
+    ~BlockPool()
+    {
+        freeList(local_);
+        freeList(remote_.exchange(nullptr, std::memory_order_acquire));
+    }
+
+    void* allocate()
+    {
+        if(!isOwner())
+            return ::operator new(blockSize_);
+
+        if(local_ == nullptr)
+        {
+            // Only ever take the whole stack. Never popping single nodes is what makes it ABA free
+            local_ = remote_.exchange(nullptr, std::memory_order_acquire);
+            for(Node* node = local_; node != nullptr; node = node->next)
+                cached_++;
+        }
+        if(local_ == nullptr)
+        {
+            freshAllocations_.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(blockSize_);
+        }
+        Node* node = local_;
+        local_ = node->next;
+        cached_--;
+        reusedAllocations_.fetch_add(1, std::memory_order_relaxed);
+        return node;
+    }
+
+    void deallocate(void* ptr)
+    {
+        Node* node = static_cast<Node*>(ptr);
+        if(isOwner())
+        {
+            if(cached_ >= maxCached_)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+            node->next = local_;
+            local_ = node;
+            cached_++;
+            return;
+        }
+
+        remoteFrees_.fetch_add(1, std::memory_order_relaxed);
+        node->next = remote_.load(std::memory_order_relaxed);
+        while(!remote_.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    size_t blockSize() const
+    {
+        return blockSize_;
+    }
+
+    PoolStats stats() const
+    {
+        PoolStats stats;
+        stats.freshAllocations = freshAllocations_.load(std::memory_order_relaxed);
+        stats.reusedAllocations = reusedAllocations_.load(std::memory_order_relaxed);
+        stats.remoteFrees = remoteFrees_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+protected:
+    struct Node
+    {
+        Node* next;
+    };
+
+    bool isOwner()
+    {
+        auto self = std::this_thread::get_id();
+        auto owner = owner_.load(std::memory_order_relaxed);
+        if(owner == std::thread::id())
+        {
+            owner_.store(self, std::memory_order_relaxed);
+            return true;
+        }
+        return owner == self;
+    }
+
+    static void freeList(Node* node)
+    {
+        while(node != nullptr)
+        {
+            Node* next = node->next;
+            ::operator delete(node);
+            node = next;
+        }
+    }
+
+    const size_t blockSize_;
+    const size_t maxCached_;
+    std::atomic<std::thread::id> owner_{};
+    Node* local_ = nullptr;
+    size_t cached_ = 0;
+    std::atomic<uint64_t> freshAllocations_{0};
+    std::atomic<uint64_t> reusedAllocations_{0};
+    std::atomic<uint64_t> remoteFrees_{0};
+    alignas(64) std::atomic<Node*> remote_{nullptr};
+};
+
+/**
+ * @brief Standard allocator drawing from a BlockPool. Requests that don't fit in a block go to the system allocator.
+ */
+template <typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+
+    explicit PoolAllocator(std::shared_ptr<BlockPool> pool) noexcept
+        : pool_(std::move(pool))
+    {
+    }
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept
+        : pool_(other.pool_)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if(fits(n))
+            return static_cast<T*>(pool_->allocate());
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n)
+    {
+        if(fits(n))
+            pool_->deallocate(ptr);
+        else
+            ::operator delete(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const
+    {
+        return pool_ == other.pool_;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& other) const
+    {
+        return pool_ != other.pool_;
+    }
+
+private:
+    template <typename U>
+    friend class PoolAllocator;
+
+    bool fits(size_t n) const
+    {
+        return n * sizeof(T) <= pool_->blockSize() && alignof(T) <= alignof(std::max_align_t);
+    }
+
+    std::shared_ptr<BlockPool> pool_;
+};
+
+/**
+ * @brief Per-thread pool of T handed out as shared_ptr. The object and the shared_ptr control block share one pooled
+ *        block. It goes back to this pool when the last reference dies, no matter which thread that happens on.
+ */
+template <typename T>
+class ObjectPool : public trantor::NonCopyable
+{
+public:
+    // Room for the shared_ptr control block (vtable, counters and a copy of the allocator) next to T
+    static constexpr size_t blockSize = (sizeof(T) + 64 + 15) / 16 * 16;
+
+    explicit ObjectPool(size_t maxCached = 4096)
+        : blocks_(std::make_shared<BlockPool>(blockSize, maxCached))
+    {
+    }
+
+    template <typename... Args>
+    std::shared_ptr<T> make(Args&&... args)
+    {
+        return std::allocate_shared<T>(PoolAllocator<T>(blocks_), std::forward<Args>(args)...);
+    }
+
+    PoolStats stats() const
+    {
+        return blocks_->stats();
+    }
+
+protected:
+    std::shared_ptr<BlockPool> blocks_;
+};
+
+}
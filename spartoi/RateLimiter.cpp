@@ -0,0 +1,100 @@
+#include "RateLimiter.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+
+using namespace spartoi;
+
+RateLimiter::RateLimiter(const RateLimitConfig& config)
+    : config_(config)
+{
+    // A burst smaller than a single connection would reject everyone
+    config_.burst = std::max(config_.burst, 1.0);
+}
+
+double RateLimiter::refillSeconds() const
+{
+    return config_.burst / config_.requestsPerSecond;
+}
+
+bool RateLimiter::makeKey(const trantor::InetAddress& addr, Key& key)
+{
+    const struct sockaddr* sa = addr.getSockAddr();
+    if(sa->sa_family == AF_INET)
+    {
+        const auto* sin = reinterpret_cast<const struct sockaddr_in*>(sa);
+        key.hi = 0;
+        key.lo = 0xffff00000000ULL | sin->sin_addr.s_addr;
+        return true;
+    }
+    if(sa->sa_family == AF_INET6)
+    {
+        const auto* sin6 = reinterpret_cast<const struct sockaddr_in6*>(sa);
+        const uint8_t* bytes = sin6->sin6_addr.s6_addr;
+        if(IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+        {
+            // IPv4 client on a dual stack listener. Limit per address just like plain IPv4
+            uint32_t v4;
+            memcpy(&v4, bytes + 12, sizeof(v4));
+            key.hi = 0;
+            key.lo = 0xffff00000000ULL | v4;
+            return true;
+        }
+        // Only the /64 prefix. The interface identifier is picked by the client and free to change
+        memcpy(&key.hi, bytes, sizeof(key.hi));
+        key.lo = 1;
+        return true;
+    }
+    return false;
+}
+
+double RateLimiter::refill(Bucket& bucket, Clock::time_point now) const
+{
+    double elapsed = std::chrono::duration<double>(now - bucket.lastRefill).count();
+    bucket.tokens = std::min(config_.burst, bucket.tokens + elapsed * config_.requestsPerSecond);
+    bucket.lastRefill = now;
+    return bucket.tokens;
+}
+
+bool RateLimiter::allow(const trantor::InetAddress& addr, Clock::time_point now)
+{
+    Key key;
+    if(!makeKey(addr, key))
+        return true;
+
+    auto it = buckets_.find(key);
+    if(it == buckets_.end())
+    {
+        if(buckets_.size() >= config_.maxTrackedAddresses && !lru_.empty())
+        {
+            // Forget whoever was seen longest ago. Their bucket has had the most time to refill, so this is the
+            // client least likely to be throttled anyway. Constant time even during a flood of new addresses
+            buckets_.erase(lru_.back());
+            lru_.pop_back();
+        }
+        lru_.push_front(key);
+        buckets_.emplace(key, Bucket{config_.burst - 1, now, lru_.begin()});
+        return true;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second.lruPos);
+    if(refill(it->second, now) < 1)
+        return false;
+    it->second.tokens -= 1;
+    return true;
+}
+
+void RateLimiter::sweep(Clock::time_point now)
+{
+    for(auto it = buckets_.begin(); it != buckets_.end();)
+    {
+        if(refill(it->second, now) >= config_.burst)
+        {
+            lru_.erase(it->second.lruPos);
+            it = buckets_.erase(it);
+        }
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <trantor/net/InetAddress.h>
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+namespace spartoi
+{
+
+struct RateLimitConfig
+{
+    // Sustained connections per second allowed from a single client. 0 disables rate limiting
+    double requestsPerSecond = 0;
+    // Number of connections a client can make in a burst before being throttled
+    double burst = 0;
+    // Upper bound on the number of clients tracked by each IO loop. The least recently seen client is forgotten to
+    // make room for a new one
+    size_t maxTrackedAddresses = 65536;
+};
+
+/**
+ * @brief Token bucket rate limiter keyed by client address. IPv4 clients are limited per address and IPv6 clients
+ *        per /64 prefix, since a single host usually owns a whole /64. Not thread safe, one instance is meant to be
+ *        owned by every IO loop, each configured with it's share of the limit.
+ */
+class RateLimiter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RateLimiter(const RateLimitConfig& config);
+
+    /**
+     * @brief Take a token from the bucket of addr.
+     *
+     * @return false if the client is over it's limit and the connection should be dropped.
+     */
+    bool allow(const trantor::InetAddress& addr, Clock::time_point now = Clock::now());
+
+    /**
+     * @brief Drop buckets that have refilled completely. A full bucket behaves exactly like a missing one, so
+     *        this never changes the outcome of allow(). Walks every bucket, call it from a timer and not per
+     *        connection.
+     */
+    void sweep(Clock::time_point now = Clock::now());
+
+    size_t size() const
+    {
+        return buckets_.size();
+    }
+
+    /**
+     * @brief How long an idle bucket needs to fully refill. This is also a sensible interval to call sweep().
+     */
+    double refillSeconds() const;
+
+protected:
+    struct Key
+    {
+        uint64_t hi;
+        uint64_t lo;
+        bool operator==(const Key& other) const
+        {
+            return hi == other.hi && lo == other.lo;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<uint64_t>()(key.hi * 0x9e3779b97f4a7c15ULL ^ key.lo);
+        }
+    };
+
+    struct Bucket
+    {
+        double tokens;
+        Clock::time_point lastRefill;
+        std::list<Key>::iterator lruPos;
+    };
+
+    static bool makeKey(const trantor::InetAddress& addr, Key& key);
+    double refill(Bucket& bucket, Clock::time_point now) const;
+
+    RateLimitConfig config_;
+    std::unordered_map<Key, Bucket, KeyHash> buckets_;
+    // Most recently seen at the front
+    std::list<Key> lru_;
+};
+
+}
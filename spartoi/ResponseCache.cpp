@@ -0,0 +1,131 @@
+#include "ResponseCache.hpp"
+#include "SpartanClient.hpp"
+
+using namespace spartoi;
+using namespace drogon;
+
+ResponseCache::ResponseCache(size_t maxBytes, double defaultTtl)
+    : maxBytes_(maxBytes), defaultTtl_(defaultTtl)
+{
+}
+
+void ResponseCache::sendRequest(const std::string& url, const HttpReqCallback& callback, double ttl
+    , double timeout, trantor::EventLoop* loop, intmax_t maxBodySize, double maxTransferDuration)
+{
+    auto parsed = internal::parseSpartanUrl(url);
+    std::string key = internal::normalizeSpartanUrl(parsed);
+    if(ttl < 0)
+        ttl = defaultTtl_;
+
+    {
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(key);
+        if(it != entries_.end())
+        {
+            if(it->second->expiry > Clock::now())
+            {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                // Always answer asynchronously, like a real request would
+                loop->queueInLoop([callback, resp = it->second->resp]() {
+                    callback(ReqResult::Ok, resp);
+                });
+                return;
+            }
+            erase(it->second);
+        }
+
+        auto [waiters, first] = inflight_.try_emplace(key);
+        waiters->second.push_back({loop, callback});
+        if(!first)
+            return;
+    }
+
+    try
+    {
+        spartoi::sendRequest(parsed.url, [this, key, ttl](ReqResult result, const HttpResponsePtr& resp) {
+            onFetched(key, ttl, result, resp);
+        }, timeout, loop, maxBodySize, {}, maxTransferDuration);
+    }
+    catch(...)
+    {
+        std::lock_guard lock(mutex_);
+        inflight_.erase(key);
+        throw;
+    }
+}
+
+void ResponseCache::onFetched(const std::string& key, double ttl, ReqResult result, const HttpResponsePtr& resp)
+{
+    std::vector<Waiter> waiters;
+    {
+        std::lock_guard lock(mutex_);
+        auto it = inflight_.find(key);
+        if(it != inflight_.end())
+        {
+            waiters = std::move(it->second);
+            inflight_.erase(it);
+        }
+
+        if(result == ReqResult::Ok && resp != nullptr && ttl > 0)
+        {
+            const auto& status = resp->getHeader("spartan-status");
+            if(status == "2" || status == "3")
+                insert(key, resp, ttl);
+        }
+    }
+
+    for(auto& waiter : waiters)
+    {
+        waiter.loop->runInLoop([callback = std::move(waiter.callback), result, resp]() {
+            callback(result, resp);
+        });
+    }
+}
+
+void ResponseCache::insert(const std::string& key, const HttpResponsePtr& resp, double ttl)
+{
+    size_t bytes = resp->body().size() + resp->getHeader("meta").size() + 2 * key.size() + sizeof(Entry);
+    if(bytes > maxBytes_)
+        return;
+
+    auto existing = entries_.find(key);
+    if(existing != entries_.end())
+        erase(existing->second);
+    while(bytes_ + bytes > maxBytes_ && !lru_.empty())
+        erase(std::prev(lru_.end()));
+
+    auto expiry = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(ttl));
+    lru_.push_front({key, resp, bytes, expiry});
+    entries_.emplace(key, lru_.begin());
+    bytes_ += bytes;
+}
+
+void ResponseCache::erase(std::list<Entry>::iterator it)
+{
+    bytes_ -= it->bytes;
+    entries_.erase(it->key);
+    lru_.erase(it);
+}
+
+void ResponseCache::invalidate(const std::string& url)
+{
+    std::string key = internal::normalizeSpartanUrl(internal::parseSpartanUrl(url));
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(key);
+    if(it != entries_.end())
+        erase(it->second);
+}
+
+void ResponseCache::clear()
+{
+    std::lock_guard lock(mutex_);
+    lru_.clear();
+    entries_.clear();
+    bytes_ = 0;
+}
+
+size_t ResponseCache::size() const
+{
+    std::lock_guard lock(mutex_);
+    return bytes_;
+}
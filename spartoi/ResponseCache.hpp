@@ -0,0 +1,86 @@
+#pragma once
+
+#include <drogon/HttpResponse.h>
+#include <drogon/HttpTypes.h>
+#include <drogon/drogon.h>
+#include <trantor/net/EventLoop.h>
+#include <trantor/utils/NonCopyable.h>
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace spartoi
+{
+
+/**
+ * @brief Caching front end for sendRequest(). Successful responses (Spartan status 2 and 3) are kept until their TTL
+ *        runs out or they get evicted as the least recently used entry once the cache is full. Concurrent requests
+ *        for the same uncached URL share one fetch.
+ *
+ *        Every caller of a cached URL gets the same HttpResponse object. Treat it as read-only.
+ *        The cache is thread safe and must outlive all requests made through it.
+ */
+class ResponseCache : public trantor::NonCopyable
+{
+public:
+    /**
+     * @param maxBytes upper bound of the (approximate) memory used by cached responses
+     * @param defaultTtl seconds a response stays cached when no TTL is given per request
+     */
+    explicit ResponseCache(size_t maxBytes = 64 * 1024 * 1024, double defaultTtl = 60);
+
+    /**
+     * @brief Same as spartoi::sendRequest() but served from the cache when possible. A request joining a fetch
+     *        already in flight uses the timeouts and limits of that fetch.
+     *
+     * @param ttl seconds to cache the response for. Negative uses the default TTL
+     */
+    void sendRequest(const std::string& url, const drogon::HttpReqCallback& callback, double ttl = -1
+        , double timeout = 0, trantor::EventLoop* loop = drogon::app().getLoop(), intmax_t maxBodySize = -1
+        , double maxTransferDuration = 0);
+
+    void invalidate(const std::string& url);
+    void clear();
+
+    /**
+     * @brief Approximate number of bytes used by cached responses.
+     */
+    size_t size() const;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        std::string key;
+        drogon::HttpResponsePtr resp;
+        size_t bytes;
+        Clock::time_point expiry;
+    };
+
+    struct Waiter
+    {
+        trantor::EventLoop* loop;
+        drogon::HttpReqCallback callback;
+    };
+
+    void onFetched(const std::string& key, double ttl, drogon::ReqResult result, const drogon::HttpResponsePtr& resp);
+    void insert(const std::string& key, const drogon::HttpResponsePtr& resp, double ttl);
+    void erase(std::list<Entry>::iterator it);
+
+    const size_t maxBytes_;
+    const double defaultTtl_;
+
+    mutable std::mutex mutex_;
+    // Most recently used at the front
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+    std::unordered_map<std::string, std::vector<Waiter>> inflight_;
+    size_t bytes_ = 0;
+};
+
+}
@@ -1,12 +1,20 @@
 #include "SpartanClient.hpp"
+#include "SpartanServer.hpp"
 #include <trantor/net/TcpClient.h>
 #include <trantor/net/Resolver.h>
 #include <trantor/utils/MsgBuffer.h>
 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
 #include <regex>
 #include <string>
+#include <unistd.h>
 #include <sstream>
 #include <algorithm>
+#include <cctype>
 
 using namespace drogon;
 
@@ -59,22 +67,22 @@ namespace spartoi
 namespace internal
 {
 
-SpartanClient::SpartanClient(std::string url, trantor::EventLoop* loop, double timeout, intmax_t maxBodySize, double maxTransferDuration)
-    : loop_(loop), timeout_(timeout), maxBodySize_(maxBodySize), maxTransferDuration_(maxTransferDuration)
+SpartanUrl parseSpartanUrl(const std::string& url)
 {
     static const std::regex re(R"(([a-z]+):\/\/([^\/:]+)(?:\:([0-9]+))?($|\/.*))");
     std::smatch match;
     if(!std::regex_match(url, match, re))
         throw std::invalid_argument(url + " is no a valid url");
 
+    SpartanUrl result;
     std::string protocol = match[1];
-    host_ = match[2];
+    result.host = match[2];
     std::string port = match[3];
     std::string path = match[4];
 
     if(protocol != "spartan")
         throw std::invalid_argument("Must be a spartan URL");
-    port_ = 300;
+    result.port = 300;
     if(port.empty() == false)
     {
         int portNum = std::stoi(port);
@@ -82,21 +90,47 @@ SpartanClient::SpartanClient(std::string url, trantor::EventLoop* loop, double t
         {
             LOG_ERROR << port << "is not a valid port number";
         }
-        port_ = portNum;
+        result.port = portNum;
     }
 
     if(path.empty() && url.back() != '/') {
-		url_ = url + "/";
-		path_ = "/";
+		result.url = url + "/";
+		result.path = "/";
 	}
     else {
-		url_ = url;
-		path_ = path;
+		result.url = url;
+		result.path = path;
 	}
+    return result;
+}
+
+std::string normalizeSpartanUrl(const SpartanUrl& url)
+{
+    std::string host = url.host;
+    std::transform(host.begin(), host.end(), host.begin(), [](unsigned char c) { return std::tolower(c); });
+    return "spartan://" + host + ":" + std::to_string((unsigned short)url.port) + (url.path.empty() ? "/" : url.path);
+}
+
+SpartanClient::SpartanClient(std::string url, trantor::EventLoop* loop, double timeout, intmax_t maxBodySize, double maxTransferDuration)
+    : loop_(loop), timeout_(timeout), maxBodySize_(maxBodySize), maxTransferDuration_(maxTransferDuration)
+{
+    auto parsed = parseSpartanUrl(url);
+    host_ = std::move(parsed.host);
+    port_ = parsed.port;
+    path_ = std::move(parsed.path);
+    url_ = std::move(parsed.url);
 }
 
 void SpartanClient::fire()
 {
+    traceId_ = tracing::newTrace();
+    if(traceId_ != 0)
+        traceStart_ = traceMark_ = tracing::Clock::now();
+    if(loopbackServer_ != nullptr)
+    {
+        sendRequestInLoop();
+        return;
+    }
     if(isIPString(host_))
     {
         bool isIpV6 = host_.find(":") != std::string::npos;
@@ -104,24 +138,84 @@ void SpartanClient::fire()
         sendRequestInLoop();
         return;
     }
-    resolver_ = trantor::Resolver::newResolver(loop_, 10);
+    if(!resolver_)
+        resolver_ = trantor::Resolver::newResolver(loop_, 10);
     resolver_->resolve(host_, [thisPtr=shared_from_this()](const trantor::InetAddress &addr){
         if(addr.ipNetEndian() == 0)
         {
             thisPtr->haveResult(ReqResult::BadServerAddress, nullptr);
             return;
         }
+        tracing::step(thisPtr->traceId_, "dns", thisPtr->traceMark_);
         thisPtr->peerAddress_ = trantor::InetAddress(addr.toIp(), thisPtr->port_, addr.isIpV6());
         thisPtr->sendRequestInLoop();
     });
 }
 
-void SpartanClient::haveResult(drogon::ReqResult result, const trantor::MsgBuffer* msg)
+SpartanClient::~SpartanClient()
+{
+    closeDownloadFile();
+}
+
+void SpartanClient::closeDownloadFile()
+{
+    if(closeDownloadFd_ && downloadFd_ >= 0)
+        ::close(downloadFd_);
+    closeDownloadFd_ = false;
+}
+
+bool SpartanClient::writeBody(trantor::MsgBuffer* msg)
+{
+    size_t size = msg->readableBytes();
+    if(maxBodySize_ > 0 && downloadResult_.bytesWritten + size > size_t(maxBodySize_))
+    {
+        size = size_t(maxBodySize_) - downloadResult_.bytesWritten;
+        downloadResult_.bodyTooLarge = true;
+    }
+
+    const char* data = msg->peek();
+    size_t written = 0;
+    while(written < size)
+    {
+        ssize_t n = ::write(downloadFd_, data + written, size - written);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            LOG_ERROR << "Failed to write downloaded body: " << strerror(errno);
+            msg->retrieveAll();
+            return false;
+        }
+        written += n;
+    }
+    downloadResult_.bytesWritten += written;
+    msg->retrieveAll();
+    return !downloadResult_.bodyTooLarge;
+}
+
+void SpartanClient::invokeCallback(drogon::ReqResult result, const drogon::HttpResponsePtr& resp)
+{
+    if(downloadFd_ < 0)
+    {
+        callback_(result, resp);
+        return;
+    }
+    // Make sure everything is on disk (well, in the page cache) before the user looks at the file
+    closeDownloadFile();
+    downloadCallback_(result, resp, downloadResult_);
+}
+
+void SpartanClient::haveResult(drogon::ReqResult result, trantor::MsgBuffer* msg)
 {
     loop_->assertInLoopThread();
     if(callbackCalled_ == true)
         return;
     callbackCalled_ = true;
+    if(traceId_ != 0)
+    {
+        tracing::step(traceId_, result == ReqResult::Ok ? "transfer" : "failed", traceMark_);
+        tracing::span(traceId_, "request", traceStart_, traceMark_);
+    }
 
     if(timeout_ > 0)
         loop_->invalidateTimer(timeoutTimerId_);
@@ -129,20 +223,31 @@ void SpartanClient::haveResult(drogon::ReqResult result, const trantor::MsgBuffe
         loop_->invalidateTimer(transferTimerId_);
     if(result != ReqResult::Ok)
     {
-        client_ = nullptr;
-        callback_(result, nullptr);
+        releaseConnection();
+        invokeCallback(result, nullptr);
         return;
     }
     if(!headerReceived_)
     {
-        client_ = nullptr;
-        callback_(ReqResult::BadResponse, nullptr);
+        releaseConnection();
+        invokeCallback(ReqResult::BadResponse, nullptr);
         return;
     }
 
     // check ok. now we can get the body
     auto resp = HttpResponse::newHttpResponse();
-    resp->setBody(std::string(msg->peek(), msg->peek()+msg->readableBytes()));
+    if(downloadFd_ >= 0)
+    {
+        // Whatever arrived after the last read callback
+        if(!writeBody(msg))
+        {
+            releaseConnection();
+            invokeCallback(ReqResult::BadResponse, nullptr);
+            return;
+        }
+    }
+    else if(msg != nullptr)
+        resp->setBody(std::string(msg->peek(), msg->peek()+msg->readableBytes()));
     resp->addHeader("meta", resoneseMeta_);
     resp->addHeader("spartan-status", std::to_string(responseStatus_));
     int httpStatus;
@@ -171,49 +276,75 @@ void SpartanClient::haveResult(drogon::ReqResult result, const trantor::MsgBuffe
     else
         resp->setContentTypeCode(CT_NONE);
     // we need the client no more. Let's release this as soon as possible to save open file descriptors
+    releaseConnection();
+    invokeCallback(ReqResult::Ok, resp);
+}
+
+void SpartanClient::onConnection(const trantor::TcpConnectionPtr &connPtr)
+{
+    LOG_TRACE << "This is " << (void*)this;
+
+    if(connPtr->connected())
+    {
+        tracing::step(traceId_, "connect", traceMark_);
+        LOG_TRACE << "Connected to server. Sending request. Host and path is : "
+            << host_ << " " << path_;
+        connPtr->send(host_ + " " + path_ + " 0\r\n");
+    }
+    else
+    {
+        haveResult(ReqResult::Ok, connPtr->getRecvBuffer());
+    }
+}
+
+void SpartanClient::releaseConnection()
+{
     client_ = nullptr;
-    callback_(ReqResult::Ok, resp);
+    if(loopbackConn_)
+    {
+        loopbackConn_->forceClose();
+        loopbackConn_ = nullptr;
+    }
 }
 
 void SpartanClient::sendRequestInLoop()
 {
     // TODO: Validate certificate
     auto weakPtr = weak_from_this();
-    client_ = std::make_shared<trantor::TcpClient>(loop_, peerAddress_, "SpartanClient");
-
-    client_->setMessageCallback([weakPtr](const trantor::TcpConnectionPtr &connPtr,
+    auto messageCallback = [weakPtr](const trantor::TcpConnectionPtr &connPtr,
               trantor::MsgBuffer *msg) {
         auto thisPtr = weakPtr.lock();
         if (thisPtr)
         {
             thisPtr->onRecvMessage(connPtr, msg);
         }
-    });
-    client_->setConnectionCallback([weakPtr, this](const trantor::TcpConnectionPtr &connPtr) {
+    };
+    auto connectionCallback = [weakPtr](const trantor::TcpConnectionPtr &connPtr) {
         auto thisPtr = weakPtr.lock();
         if(!thisPtr)
             return;
-        LOG_TRACE << "This is " << (void*)thisPtr.get();
+        thisPtr->onConnection(connPtr);
+    };
 
-        if(connPtr->connected())
-        {
-            LOG_TRACE << "Connected to server. Sending request. Host and path is : "
-				<< thisPtr->host_ << " " << thisPtr->path_;; 
-            connPtr->send(host_ + " " + path_ + " 0\r\n");
-        }
-        else
-        {
-            haveResult(ReqResult::Ok, connPtr->getRecvBuffer());
-        }
-    });
-
-    client_->setConnectionErrorCallback([weakPtr]() {
-        auto thisPtr = weakPtr.lock();
-        if (!thisPtr)
-            return;
-        // can't connect to server
-        thisPtr->haveResult(ReqResult::NetworkFailure, nullptr);
-    });
+    if(loopbackServer_ == nullptr)
+    {
+        client_ = std::make_shared<trantor::TcpClient>(loop_, peerAddress_, "SpartanClient");
+        client_->setMessageCallback(messageCallback);
+        client_->setConnectionCallback(connectionCallback);
+        client_->setConnectionErrorCallback([weakPtr]() {
+            auto thisPtr = weakPtr.lock();
+            if (!thisPtr)
+                return;
+            // can't connect to server
+            thisPtr->haveResult(ReqResult::NetworkFailure, nullptr);
+        });
+    }
+    else
+    {
+        loopbackConn_ = loopbackServer_->connectLoopback(loop_);
+        loopbackConn_->setMessageCallback(messageCallback);
+        loopbackConn_->setConnectionCallback(connectionCallback);
+    }
 
     if(timeout_ > 0)
     {
@@ -233,7 +364,10 @@ void SpartanClient::sendRequestInLoop()
             thisPtr->haveResult(ReqResult::Timeout, nullptr);
         });
     }
-    client_->connect();
+    if(client_)
+        client_->connect();
+    else
+        loopbackConn_->connectEstablished();
 }
 
 void SpartanClient::onRecvMessage(const trantor::TcpConnectionPtr &connPtr,
@@ -242,18 +376,27 @@ void SpartanClient::onRecvMessage(const trantor::TcpConnectionPtr &connPtr,
     if(timeout_ > 0)
         loop_->invalidateTimer(timeoutTimerId_);
     LOG_TRACE << "Got data from Spartan server";
+    if(traceId_ != 0 && !firstByteTraced_)
+    {
+        firstByteTraced_ = true;
+        tracing::step(traceId_, "first byte", traceMark_);
+    }
     if(!headerReceived_)
     {
         const char* crlf = msg->findCRLF();
         if(crlf == nullptr)
         {
+            // Don't keep buffering a server that never ends the header line
+            if(msg->readableBytes() > maxHeaderSize)
+                haveResult(ReqResult::BadResponse, nullptr);
             return;
         }
         headerReceived_ = true;
 
         const std::string_view header(msg->peek(), std::distance(msg->peek(), crlf));
         LOG_TRACE << "Spartan header is: " << header;
-        if(header.size() < 1 || (header.size() >= 2 && header[1] != ' '))
+        if(header.size() < 1 || !isdigit(static_cast<unsigned char>(header[0]))
+            || (header.size() >= 2 && header[1] != ' '))
         {
             // bad response
             haveResult(ReqResult::BadResponse, nullptr);
@@ -267,6 +410,7 @@ void SpartanClient::onRecvMessage(const trantor::TcpConnectionPtr &connPtr,
         {
             std::string mime = resoneseMeta_.substr(0, resoneseMeta_.find_first_of("; ,"));
             if(std::find(downloadMimes_.begin(), downloadMimes_.end(), mime) == downloadMimes_.end()) {
+                downloadResult_.mimeRejected = true;
                 msg->retrieveAll();
                 LOG_TRACE << "Ignoring file of MIME " << mime;
                 connPtr->forceClose(); // this triggers the connection close handler which will call haveResult
@@ -274,8 +418,24 @@ void SpartanClient::onRecvMessage(const trantor::TcpConnectionPtr &connPtr,
             }
         }
         msg->read(std::distance(msg->peek(), crlf)+2);
+        if(probe_)
+        {
+            // Everything wanted is here. Closing now saves receiving (and buffering) the body
+            msg->retrieveAll();
+            haveResult(ReqResult::Ok, nullptr);
+            return;
+        }
     }
-    if(maxBodySize_ > 0 && msg->readableBytes() > size_t(maxBodySize_))
+    if(downloadFd_ >= 0)
+    {
+        // Stream the body out as it comes. Nothing is kept in the buffer
+        if(!writeBody(msg))
+        {
+            haveResult(ReqResult::BadResponse, nullptr);
+            return;
+        }
+    }
+    else if(maxBodySize_ > 0 && msg->readableBytes() > size_t(maxBodySize_))
     {
         LOG_DEBUG << "Recived more data than " << maxBodySize_ << " bites";
         // bad response
@@ -301,29 +461,208 @@ void SpartanClient::onRecvMessage(const trantor::TcpConnectionPtr &connPtr,
 
 static std::map<int, std::shared_ptr<internal::SpartanClient>> holder;
 static std::mutex holderMutex;
+
+// Keep the client alive until it's callback is called
+static int holdClient(const std::shared_ptr<internal::SpartanClient>& client)
+{
+    int id;
+    std::lock_guard lock(holderMutex);
+    for(id = std::abs(rand())+1; holder.find(id) != holder.end(); id = std::abs(rand())+1);
+    holder[id] = client;
+    return id;
+}
+
+static void releaseClient(int id, trantor::EventLoop* loop)
+{
+    std::lock_guard lock(holderMutex);
+    auto it = holder.find(id);
+    assert(it != holder.end());
+    loop->queueInLoop([client = it->second]() {
+        // client is destroyed here
+    });
+    holder.erase(it);
+}
+
 void sendRequest(const std::string& url, const HttpReqCallback& callback, double timeout
     , trantor::EventLoop* loop, intmax_t maxBodySize, const std::vector<std::string>& mimes
     , double maxTransferDuration)
 {
     auto client = std::make_shared<internal::SpartanClient>(url, loop, timeout, maxBodySize, maxTransferDuration);
-    int id;
-    {
-        std::lock_guard lock(holderMutex);
-        for(id = std::abs(rand())+1; holder.find(id) != holder.end(); id = std::abs(rand())+1);
-        holder[id] = client;
-    }
+    int id = holdClient(client);
     client->setCallback([callback, id, loop] (ReqResult result, const HttpResponsePtr& resp) mutable {
         callback(result, resp);
+        releaseClient(id, loop);
+    });
+    client->setMimes(mimes);
+    client->fire();
+}
+
+void sendLoopbackRequest(SpartanServer& server, const std::string& url, const HttpReqCallback& callback
+    , double timeout, trantor::EventLoop* loop, intmax_t maxBodySize, const std::vector<std::string>& mimes
+    , double maxTransferDuration)
+{
+    auto client = std::make_shared<internal::SpartanClient>(url, loop, timeout, maxBodySize, maxTransferDuration);
+    int id = holdClient(client);
+    client->setCallback([callback, id, loop] (ReqResult result, const HttpResponsePtr& resp) mutable {
+        callback(result, resp);
+        releaseClient(id, loop);
+    });
+    client->setMimes(mimes);
+    client->setLoopbackServer(&server);
+    client->fire();
+}
+
+void probe(const std::string& url, const HttpReqCallback& callback, double timeout, trantor::EventLoop* loop)
+{
+    auto client = std::make_shared<internal::SpartanClient>(url, loop, timeout);
+    int id = holdClient(client);
+    client->setCallback([callback, id, loop] (ReqResult result, const HttpResponsePtr& resp) mutable {
+        callback(result, resp);
+        releaseClient(id, loop);
+    });
+    client->setProbe(true);
+    client->fire();
+}
+
+namespace
+{
+struct ProbeBatch
+{
+    std::vector<std::string> urls;
+    ProbeCallback callback;
+    std::function<void()> done;
+    size_t concurrency;
+    double timeout;
+    trantor::EventLoop* loop;
+    std::shared_ptr<trantor::Resolver> resolver;
+    size_t next = 0;
+    size_t inflight = 0;
+};
+}
 
-        std::lock_guard lock(holderMutex);
-        auto it = holder.find(id);
-        assert(it != holder.end());
-        loop->queueInLoop([client = it->second]() {
-            // client is destroyed here
+// Only ever runs on batch->loop, so the batch needs no locking
+static void probeMore(const std::shared_ptr<ProbeBatch>& batch)
+{
+    while(batch->inflight < batch->concurrency && batch->next < batch->urls.size())
+    {
+        size_t idx = batch->next++;
+        std::shared_ptr<internal::SpartanClient> client;
+        try
+        {
+            client = std::make_shared<internal::SpartanClient>(batch->urls[idx], batch->loop, batch->timeout);
+        }
+        catch(const std::exception& e)
+        {
+            batch->callback(batch->urls[idx], ReqResult::BadServerAddress, nullptr);
+            continue;
+        }
+        batch->inflight++;
+        int id = holdClient(client);
+        client->setCallback([batch, idx, id] (ReqResult result, const HttpResponsePtr& resp) {
+            batch->inflight--;
+            batch->callback(batch->urls[idx], result, resp);
+            releaseClient(id, batch->loop);
+            probeMore(batch);
         });
-        holder.erase(it);
+        client->setProbe(true);
+        client->setResolver(batch->resolver);
+        client->fire();
+    }
+
+    if(batch->inflight == 0 && batch->next == batch->urls.size() && batch->done)
+    {
+        auto done = std::move(batch->done);
+        batch->done = nullptr;
+        done();
+    }
+}
+
+void probeUrls(std::vector<std::string> urls, const ProbeCallback& callback, size_t concurrency, double timeout
+    , trantor::EventLoop* loop, std::function<void()> done)
+{
+    auto batch = std::make_shared<ProbeBatch>();
+    batch->urls = std::move(urls);
+    batch->callback = callback;
+    batch->done = std::move(done);
+    batch->concurrency = std::max<size_t>(concurrency, 1);
+    batch->timeout = timeout;
+    batch->loop = loop;
+    batch->resolver = trantor::Resolver::newResolver(loop, 10);
+    loop->runInLoop([batch]() {
+        probeMore(batch);
+    });
+}
+
+static void startDownload(const std::shared_ptr<internal::SpartanClient>& client, int fd, bool closeFd
+    , const DownloadCallback& callback, trantor::EventLoop* loop, const std::vector<std::string>& mimes)
+{
+    int id = holdClient(client);
+    client->setDownloadTarget(fd, closeFd, [callback, id, loop] (ReqResult result, const HttpResponsePtr& resp
+        , const DownloadResult& download) {
+        callback(result, resp, download);
+        releaseClient(id, loop);
     });
     client->setMimes(mimes);
     client->fire();
 }
+
+void downloadToFile(const std::string& url, int fd, const DownloadCallback& callback, double timeout
+    , trantor::EventLoop* loop, intmax_t maxBodySize, const std::vector<std::string>& mimes
+    , double maxTransferDuration)
+{
+    auto client = std::make_shared<internal::SpartanClient>(url, loop, timeout, maxBodySize, maxTransferDuration);
+    startDownload(client, fd, false, callback, loop, mimes);
+}
+
+void downloadToFile(const std::string& url, const std::string& path, const DownloadCallback& callback, double timeout
+    , trantor::EventLoop* loop, intmax_t maxBodySize, const std::vector<std::string>& mimes
+    , double maxTransferDuration)
+{
+    // Parses the URL. Nothing on disk is touched if it's invalid
+    auto client = std::make_shared<internal::SpartanClient>(url, loop, timeout, maxBodySize, maxTransferDuration);
+
+    // Download next to the destination and only move it in place once complete. An existing file survives failures.
+    // Not mkostemp(): it creates the file 0600, open() applies the umask to 0666 like any other new file would get
+    std::string tmpPath;
+    int fd = -1;
+    std::random_device random;
+    for(int attempt = 0; fd < 0 && attempt < 100; attempt++)
+    {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".%08x", unsigned(random()));
+        tmpPath = path + suffix;
+        fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if(fd < 0 && errno != EEXIST)
+            break;
+    }
+    if(fd < 0)
+        throw std::runtime_error("Cannot create " + tmpPath + ": " + strerror(errno));
+
+    auto finish = [callback, tmpPath, path] (ReqResult result, const HttpResponsePtr& resp
+        , const DownloadResult& download) {
+        // Ok only means the server closed the connection normally. Error responses, redirects and rejected MIMEs
+        // must not replace the file either
+        bool complete = result == ReqResult::Ok && resp != nullptr && resp->statusCode() == k200OK
+            && !download.mimeRejected;
+        if(complete && ::rename(tmpPath.c_str(), path.c_str()) != 0)
+        {
+            LOG_ERROR << "Failed to move download to " << path << ": " << strerror(errno);
+            result = ReqResult::BadResponse;
+            complete = false;
+        }
+        if(!complete)
+            ::unlink(tmpPath.c_str());
+        callback(result, resp, download);
+    };
+    try
+    {
+        startDownload(client, fd, true, finish, loop, mimes);
+    }
+    catch(...)
+    {
+        ::close(fd);
+        ::unlink(tmpPath.c_str());
+        throw;
+    }
+}
 }
@@ -7,6 +7,7 @@
 #include <trantor/net/InetAddress.h>
 #include <trantor/utils/Logger.h>
 #include <trantor/net/callbacks.h>
+#include "Tracing.hpp"
 
 #include <memory>
 #include <string>
@@ -26,13 +27,52 @@ class Resolver;
 namespace spartoi
 {
 
+class SpartanServer;
+class LoopbackConnection;
+
+struct DownloadResult
+{
+    // Number of body bytes written to the destination file
+    size_t bytesWritten = 0;
+    // The server sent more than maxBodySize bytes. The file is truncated to maxBodySize
+    bool bodyTooLarge = false;
+    // The response's MIME isn't in the requested list. Nothing of the body is written
+    bool mimeRejected = false;
+};
+
+using DownloadCallback = std::function<void(drogon::ReqResult, const drogon::HttpResponsePtr&, const DownloadResult&)>;
+using ProbeCallback = std::function<void(const std::string& url, drogon::ReqResult, const drogon::HttpResponsePtr&)>;
+
 namespace internal
 {
 
+struct SpartanUrl
+{
+    std::string host;
+    short port;
+    std::string path;
+    // The full URL, with a trailing / added if the path is empty
+    std::string url;
+};
+
+/**
+ * @brief Split a spartan:// URL into it's parts. Throws std::invalid_argument if url is not a valid Spartan URL.
+ */
+SpartanUrl parseSpartanUrl(const std::string& url);
+
+/**
+ * @brief Canonical form of url. Equivalent URLs (case of the host, implicit port, missing /) map to the same string.
+ */
+std::string normalizeSpartanUrl(const SpartanUrl& url);
+
 class SpartanClient : public std::enable_shared_from_this<SpartanClient>
 {
 public:
+    // Longest response header line accepted. Servers sending more without a CRLF get a BadResponse
+    static constexpr size_t maxHeaderSize = 4096;
+
     SpartanClient(std::string url, trantor::EventLoop* loop, double timeout = 0, intmax_t maxBodySize = 0x2000000, double maxTransferDuration = 900);
+    ~SpartanClient();
     void fire();
     void setCallback(const drogon::HttpReqCallback& callback)
     {
@@ -55,11 +95,59 @@ public:
         downloadMimes_ = mimes;
     }
 
+    /**
+     * @brief Write the response body to a file instead of the response. The body is written out as it arrives, so
+     *        memory usage stays the same no matter how large the file is. The response passed to callback has an
+     *        empty body.
+     *
+     * @param fd file descriptor to write to. Must be blocking
+     * @param closeFd close fd once the transfer is done
+     * @param callback invoked instead of the one set by setCallback()
+     */
+    void setDownloadTarget(int fd, bool closeFd, DownloadCallback callback)
+    {
+        downloadFd_ = fd;
+        closeDownloadFd_ = closeFd;
+        downloadCallback_ = std::move(callback);
+    }
+
+    /**
+     * @brief Talk to server through an in-memory connection instead of TCP. The host and port of the URL are only
+     *        used in the request line, no DNS lookup or connect happens.
+     */
+    void setLoopbackServer(SpartanServer* server)
+    {
+        loopbackServer_ = server;
+    }
+
+    /**
+     * @brief Only fetch the header. The connection is closed as soon as the header line arrives and the response
+     *        carries the status and meta with an empty body.
+     */
+    void setProbe(bool probe)
+    {
+        probe_ = probe;
+    }
+
+    /**
+     * @brief Resolve the host with resolver instead of creating one for this request. For sharing the resolver (and
+     *        it's cache) between many requests.
+     */
+    void setResolver(const std::shared_ptr<trantor::Resolver>& resolver)
+    {
+        resolver_ = resolver;
+    }
+
 protected:
     void sendRequestInLoop();
+    void onConnection(const trantor::TcpConnectionPtr &connPtr);
+    void releaseConnection();
     void onRecvMessage(const trantor::TcpConnectionPtr &connPtr,
                     trantor::MsgBuffer *msg);
-    void haveResult(drogon::ReqResult result, const trantor::MsgBuffer* msg);
+    void haveResult(drogon::ReqResult result, trantor::MsgBuffer* msg);
+    void invokeCallback(drogon::ReqResult result, const drogon::HttpResponsePtr& resp);
+    bool writeBody(trantor::MsgBuffer* msg);
+    void closeDownloadFile();
 
     // User specifable values
     trantor::EventLoop* loop_;
@@ -83,6 +171,17 @@ protected:
     std::vector<std::string> downloadMimes_;
     trantor::TimerId transferTimerId_;
     bool callbackCalled_ = false;
+    int downloadFd_ = -1;
+    bool closeDownloadFd_ = false;
+    DownloadCallback downloadCallback_;
+    DownloadResult downloadResult_;
+    SpartanServer* loopbackServer_ = nullptr;
+    std::shared_ptr<LoopbackConnection> loopbackConn_;
+    uint64_t traceId_ = 0;
+    tracing::Clock::time_point traceStart_;
+    tracing::Clock::time_point traceMark_;
+    bool firstByteTraced_ = false;
+    bool probe_ = false;
 };
 
 }
@@ -91,6 +190,48 @@ void sendRequest(const std::string& url, const drogon::HttpReqCallback& callback
     , trantor::EventLoop* loop=drogon::app().getLoop(), intmax_t maxBodySize = -1, const std::vector<std::string>& mimes = {}
     , double maxTransferDuration=0);
 
+/**
+ * @brief Same as sendRequest() but over an in-memory connection to server running in the same process. No sockets are
+ *        involved, which makes it suitable for measuring protocol overhead and for deterministic tests.
+ */
+void sendLoopbackRequest(SpartanServer& server, const std::string& url, const drogon::HttpReqCallback& callback
+    , double timeout = 0, trantor::EventLoop* loop=drogon::app().getLoop(), intmax_t maxBodySize = -1
+    , const std::vector<std::string>& mimes = {}, double maxTransferDuration=0);
+
+/**
+ * @brief Fetch only the status and meta of url. The connection is closed once the header arrives, so the body is
+ *        never transferred. resp has an empty body.
+ */
+void probe(const std::string& url, const drogon::HttpReqCallback& callback, double timeout = 0
+    , trantor::EventLoop* loop=drogon::app().getLoop());
+
+/**
+ * @brief probe() every URL in urls, at most concurrency at a time, all on loop and sharing one DNS resolver. callback
+ *        is called once per URL (with BadServerAddress for malformed ones) and done once after the last of them.
+ */
+void probeUrls(std::vector<std::string> urls, const ProbeCallback& callback, size_t concurrency = 64
+    , double timeout = 10, trantor::EventLoop* loop=drogon::app().getLoop(), std::function<void()> done = {});
+
+/**
+ * @brief Download the body of url into fd without holding it in memory. The callback receives the response header,
+ *        how many bytes are written and whether the body exceeded maxBodySize (the result is BadResponse if it did).
+ *        fd is not closed.
+ */
+void downloadToFile(const std::string& url, int fd, const DownloadCallback& callback, double timeout = 0
+    , trantor::EventLoop* loop=drogon::app().getLoop(), intmax_t maxBodySize = -1, const std::vector<std::string>& mimes = {}
+    , double maxTransferDuration=0);
+
+/**
+ * @brief Same as above but writes to the file at path. The body goes to a temporary file next to it, which replaces
+ *        path only if the server answered 2 with an accepted MIME. Otherwise (a failed transfer, a 3/4/5 response or
+ *        a rejected MIME) path is left as it was; check the response status to tell them apart. The file is created
+ *        with 0666 minus the umask. Throws std::invalid_argument if url is invalid and std::runtime_error if the
+ *        temporary file can't be created.
+ */
+void downloadToFile(const std::string& url, const std::string& path, const DownloadCallback& callback, double timeout = 0
+    , trantor::EventLoop* loop=drogon::app().getLoop(), intmax_t maxBodySize = -1, const std::vector<std::string>& mimes = {}
+    , double maxTransferDuration=0);
+
 #ifdef __cpp_impl_coroutine
 namespace internal
 {
@@ -1,61 +1,365 @@
 #include "SpartanServer.hpp"
 #include <drogon/HttpAppFramework.h>
+#include <trantor/utils/Date.h>
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <future>
 #include <memory>
-#include <regex>
+#include <sys/stat.h>
+#ifdef SPARTOI_HAS_IO_URING
+#include "UringTransport.hpp"
+#endif
 
 using namespace drogon;
 using namespace spartoi;
 using namespace trantor;
 
 SpartanServer::SpartanServer(EventLoop* loop, const InetAddress& listenAddr)
-    : loop_(loop), server_(loop, listenAddr, "SpartanServer")
+    : loop_(loop), listenAddr_(listenAddr)
 {
     LOG_DEBUG << "Creating srver on address " << listenAddr.toIpPort();
+}
 
-    server_.setConnectionCallback([this](const TcpConnectionPtr& conn) {onConnection(conn);});
-    server_.setRecvMessageCallback([this](const TcpConnectionPtr& conn, MsgBuffer* buf){onMessage(conn, buf);});
+SpartanServer::~SpartanServer()
+{
+    for(const auto& [loop, timerId] : timers_)
+        loop->invalidateTimer(timerId);
+#ifdef SPARTOI_HAS_IO_URING
+    // Until stop() ran, completions already on their way still call onConnection() and onMessage() on this server.
+    // Wait for it on every running loop. Each UringLoop lives on until it's loop closed it's connections
+    std::vector<std::future<void>> stopped;
+    for(const auto& uring : uringLoops_)
+    {
+        EventLoop* loop = uring->loop();
+        // A loop that isn't running handles no completions before the queued stop(). Waiting on it would hang
+        if(loop->isInLoopThread() || !loop->isRunning())
+        {
+            loop->runInLoop([uring]() { uring->stop(); });
+            continue;
+        }
+        auto done = std::make_shared<std::promise<void>>();
+        stopped.push_back(done->get_future());
+        loop->runInLoop([uring, done]() {
+            uring->stop();
+            done->set_value();
+        });
+    }
+    for(auto& future : stopped)
+        future.wait();
+#endif
 }
 
-void SpartanServer::onConnection(const TcpConnectionPtr& conn)
-{}
+void SpartanServer::onConnection(const TcpConnectionPtr& conn, bool rateLimited)
+{
+    if(conn->connected())
+    {
+        // Reject before anything is allocated for the connection
+        auto limiter = rateLimited ? rateLimiters_.get(conn->getLoop()) : nullptr;
+        if(limiter != nullptr && !limiter->allow(conn->peerAddr()))
+        {
+            LOG_TRACE << "Rate limited connection from " << conn->peerAddr().toIp();
+            conn->forceClose();
+            return;
+        }
+
+        // Created on accept so the logged latency includes waiting for the header
+        auto state = newParseState(conn);
+        state->start_time = std::chrono::steady_clock::now();
+        state->trace_id = tracing::newTrace();
+        if(state->trace_id != 0)
+            state->trace_start = state->trace_mark = state->start_time;
+        conn->setContext(state);
+    }
+    else
+    {
+        auto state = conn->getContext<SpartanParseState>();
+        if(state != nullptr && state->trace_id != 0)
+        {
+            auto now = tracing::Clock::now();
+            // If the client hung up early the handler may still be moving the mark on another thread. Only read it
+            // once a response went out from this loop
+            if(state->status != 0)
+                tracing::span(state->trace_id, "write", state->trace_mark, now);
+            tracing::span(state->trace_id, "request", state->trace_start, now);
+        }
+        logAccess(conn);
+    }
+}
+
+void SpartanServer::logAccess(const TcpConnectionPtr& conn)
+{
+    auto producer = accessLogProducers_.get(conn->getLoop());
+    if(producer == nullptr)
+        return;
+    // Connections that never sent a complete header aren't requests
+    auto state = conn->getContext<SpartanParseState>();
+    if(state == nullptr || (state->req == nullptr && state->status == 0))
+        return;
+
+    AccessLogRecord record;
+    record.timestamp = Date::now().microSecondsSinceEpoch();
+    record.latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - state->start_time).count();
+    record.peer = conn->peerAddr();
+    record.uploadSize = state->content_length;
+    record.bytesSent = conn->bytesSent();
+    record.status = state->status;
+    if(state->req != nullptr)
+    {
+        record.setHost(state->req->getHeader("host"));
+        record.setPath(state->req->path());
+    }
+    producer->push(record);
+}
 
 void SpartanServer::start()
 {
-    server_.start();
+    std::vector<EventLoop*> loops;
+    if(pool_)
+        loops = pool_->getLoops();
+    else
+        loops.push_back(loop_);
+
+    if(rateLimitConfig_.requestsPerSecond > 0)
+    {
+        // Connections of one client are spread over every loop (round robin by trantor, by 4-tuple hash with
+        // SO_REUSEPORT), so each loop enforces it's share. Together they never allow more than the configured limit
+        RateLimitConfig perLoop = rateLimitConfig_;
+        perLoop.requestsPerSecond /= loops.size();
+        perLoop.burst = std::max(perLoop.burst / loops.size(), 1.0);
+        rateLimiters_.init(loops, perLoop);
+        rateLimiters_.forEach([this](EventLoop* loop, RateLimiter&) {
+            // The timer shares the limiter. Cancelling it from another thread only takes effect later on the loop
+            auto limiter = rateLimiters_.share(loop);
+            double interval = std::min(std::max(limiter->refillSeconds(), 1.0), 60.0);
+            timers_.emplace_back(loop, loop->runEvery(interval, [limiter]() { limiter->sweep(); }));
+        });
+    }
+    if(accessLog_)
+        accessLogProducers_.init(loops, *accessLog_);
+    parseStatePools_.init(loops);
+
+    if(transport_ == Transport::IoUring && startUring(loops))
+        return;
+    server_ = std::make_unique<TcpServer>(loop_, listenAddr_, "SpartanServer");
+    server_->setConnectionCallback([this](const TcpConnectionPtr& conn) {onConnection(conn);});
+    server_->setRecvMessageCallback([this](const TcpConnectionPtr& conn, MsgBuffer* buf){onMessage(conn, buf);});
+    if(pool_)
+        server_->setIoLoopThreadPool(pool_);
+    server_->start();
+}
+
+bool SpartanServer::startUring([[maybe_unused]] const std::vector<EventLoop*>& loops)
+{
+#ifdef SPARTOI_HAS_IO_URING
+    std::vector<std::shared_ptr<UringLoop>> uringLoops;
+    try
+    {
+        for(auto loop : loops)
+            uringLoops.push_back(std::make_shared<UringLoop>(loop, listenAddr_));
+    }
+    catch(const std::exception& e)
+    {
+        LOG_WARN << "Can't serve " << listenAddr_.toIpPort() << " with io_uring, using trantor instead: " << e.what();
+        return false;
+    }
+    // TcpServer would have started the pool
+    if(pool_)
+        pool_->start();
+    for(const auto& uring : uringLoops)
+    {
+        uring->loop()->runInLoop([uring, this]() {
+            uring->start([this](const TcpConnectionPtr& conn) {onConnection(conn);}
+                , [this](const TcpConnectionPtr& conn, MsgBuffer* buf){onMessage(conn, buf);});
+        });
+    }
+    uringLoops_ = std::move(uringLoops);
+    LOG_INFO << "Serving " << listenAddr_.toIpPort() << " with io_uring";
+    return true;
+#else
+    LOG_WARN << "spartoi is built without io_uring support, serving " << listenAddr_.toIpPort() << " with trantor";
+    return false;
+#endif
+}
+
+void SpartanServer::setTransport(Transport transport)
+{
+    transport_ = transport;
 }
 
 void SpartanServer::setIoThreadNum(size_t n)
 {
-    server_.setIoLoopNum(n);
+    // Keep the pool ourselves. Per-loop state needs to know which loops connections end up on
+    setIoLoopThreadPool(std::make_shared<EventLoopThreadPool>(n, "SpartanServerThreadPool"));
+}
+
+std::shared_ptr<LoopbackConnection> SpartanServer::connectLoopback(EventLoop* clientLoop)
+{
+    EventLoop* ioLoop = pool_ ? pool_->getNextLoop() : nullptr;
+    if(ioLoop == nullptr)
+        ioLoop = loop_;
+    auto [clientEnd, serverEnd] = LoopbackConnection::createPair(clientLoop, InetAddress("127.0.0.1", 0)
+        , ioLoop, listenAddr_);
+    // They all share one made up peer address and would otherwise share one token bucket
+    serverEnd->setConnectionCallback([this](const TcpConnectionPtr& conn) {onConnection(conn, false);});
+    serverEnd->setMessageCallback([this](const TcpConnectionPtr& conn, MsgBuffer* buf){onMessage(conn, buf);});
+    serverEnd->connectEstablished();
+    return clientEnd;
+}
+
+void SpartanServer::setRateLimit(const RateLimitConfig& config)
+{
+    rateLimitConfig_ = config;
+}
+
+void SpartanServer::setAccessLog(const std::shared_ptr<AccessLog>& log)
+{
+    accessLog_ = log;
 }
 
-std::pair<HttpRequestPtr, size_t> SpartanServer::parseHeader(const std::string& header)
+void SpartanServer::setVirtualHosts(const std::shared_ptr<const VirtualHostMap>& hosts)
 {
-	auto parts = drogon::utils::splitString(header, " ");
-	if(parts.size() != 3)
+    virtualHosts_ = hosts;
+}
+
+std::pair<HttpRequestPtr, size_t> SpartanServer::parseHeader(std::string_view header)
+{
+	// Split into exactly 3 space separated parts without allocating any of them. Repeated spaces are allowed
+	std::string_view parts[3];
+	size_t numParts = 0;
+	size_t pos = 0;
+	while(pos < header.size()) {
+		size_t end = header.find(' ', pos);
+		if(end == std::string_view::npos)
+			end = header.size();
+		if(end != pos) {
+			if(numParts == 3)
+				throw std::invalid_argument("Invalid header");
+			parts[numParts++] = header.substr(pos, end - pos);
+		}
+		pos = end + 1;
+	}
+	if(numParts != 3)
 		throw std::invalid_argument("Invalid header");
 
+	size_t content_length;
+	auto [end, err] = std::from_chars(parts[2].data(), parts[2].data() + parts[2].size(), content_length);
+	if(err != std::errc() || end != parts[2].data() + parts[2].size())
+		throw std::invalid_argument("Invalid content length");
+
+	// path[?query][#fragment]
+	std::string_view target = parts[1];
+	if(!target.empty() && target[0] != '/')
+		throw std::invalid_argument("Invalid path");
+	std::string_view path = target.substr(0, target.find('?'));
+	std::string_view query;
+	if(path.size() != target.size()) {
+		query = target.substr(path.size() + 1);
+		query = query.substr(0, query.find('#'));
+	}
+
 	auto req = HttpRequest::newHttpRequest();
-	req->addHeader("host", parts[0]);
+	req->addHeader("host", std::string(parts[0]));
 	req->setMethod(Get);
 	req->addHeader("protocol", "spartan");
+	req->setPath(std::string(path));
+	req->setParameter("query", std::string(query));
+	return {req, content_length};
+}
 
-	static const std::regex re(R"((\/$|$|\/[^?]*)(?:\?([^#]*))?(?:#(.*))?)");
-	std::smatch match;
-	if(!std::regex_match(parts[1], match, re))
-		throw std::invalid_argument("Invalid path");
-	
-	std::string path = match[1];
-	std::string query = match[2];
-	// std::string fragment = match[3];
+static void sendHeaderOnly(const TcpConnectionPtr& conn, int status, const std::string& meta)
+{
+    auto state = conn->getContext<SpartanParseState>();
+    if(state != nullptr)
+        state->status = status;
+    conn->send(std::to_string(status) + " " + meta + "\r\n");
+    conn->shutdown();
+}
+
+bool SpartanServer::serveStaticFile(const VirtualHost& vhost, const std::string& path, const TcpConnectionPtr& conn)
+{
+    // %00 would cut the C string short of what was checked
+    if(memchr(path.data(), '\0', path.size()) != nullptr)
+        return false;
+
+    // stat() and sendFile() only need a C string. Build it on the stack instead of allocating one per request
+    char file[PATH_MAX];
+    size_t length = vhost.documentRoot.size();
+    // Leave room for a leading "/", "/" + the implicit page and the terminator
+    if(length + path.size() + vhost.implicitPage.size() + 3 > sizeof(file))
+        return false;
+    memcpy(file, vhost.documentRoot.data(), length);
+    // Copy segment by segment. Empty segments are dropped and any segment starting with a dot is refused, which keeps
+    // requests inside the document root ("..") and away from hidden files (.git, .env, ...)
+    for(size_t pos = 0; pos < path.size();)
+    {
+        size_t end = std::min(path.find('/', pos), path.size());
+        std::string_view segment(path.data() + pos, end - pos);
+        pos = end + 1;
+        if(segment.empty())
+            continue;
+        if(segment[0] == '.')
+            return false;
+        file[length++] = '/';
+        memcpy(file + length, segment.data(), segment.size());
+        length += segment.size();
+    }
+    file[length] = '\0';
+
+    struct stat st;
+    if(stat(file, &st) != 0)
+        return false;
+    if(S_ISDIR(st.st_mode))
+    {
+        file[length++] = '/';
+        memcpy(file + length, vhost.implicitPage.data(), vhost.implicitPage.size());
+        length += vhost.implicitPage.size();
+        file[length] = '\0';
+        if(stat(file, &st) != 0)
+            return false;
+    }
+    if(!S_ISREG(st.st_mode) || !isServedFileType(vhost, std::string_view(file, length)))
+        return false;
 
-	req->setPath(path);
-	req->setParameter("query", query);
-	return {req, std::stoull(parts[2])};
+    auto state = conn->getContext<SpartanParseState>();
+    if(state != nullptr)
+        state->status = 2;
+    std::string header = "2 ";
+    header += mimeOfFile(vhost, std::string_view(file, length));
+    header += "\r\n";
+    conn->send(std::move(header));
+    conn->sendFile(file, 0, st.st_size);
+    conn->shutdown();
+    return true;
+}
+
+bool SpartanServer::dispatchVirtualHost(const HttpRequestPtr& req, const TcpConnectionPtr& conn)
+{
+    const VirtualHost* vhost = virtualHosts_->find(req->getHeader("host"));
+    if(vhost == nullptr)
+    {
+        sendHeaderOnly(conn, 4, "Unknown host");
+        return true;
+    }
+
+    auto state = conn->getContext<SpartanParseState>();
+    if(state != nullptr)
+        state->vhost = vhost;
+    if(!vhost->documentRoot.empty() && serveStaticFile(*vhost, req->path(), conn))
+        return true;
+
+    if(!vhost->handlerPrefix.empty())
+        req->setPath(vhost->handlerPrefix + req->path());
+    return false;
 }
 
 void SpartanServer::processFinishedRequest(const HttpRequestPtr& req, trantor::TcpConnectionPtr conn)
 {
+	if(virtualHosts_ && dispatchVirtualHost(req, conn))
+		return;
+
 	int idx = roundRobbinIdx_++;
     if(idx > 0x7ffff) // random large number
     {
@@ -63,27 +367,58 @@ void SpartanServer::processFinishedRequest(const HttpRequestPtr& req, trantor::T
         roundRobbinIdx_ = 0;
     }
     idx = idx % app().getThreadNum();
+    // Only the connection's loop touches the state until the response is sent, no need to keep looking it up
+    auto state = conn->getContext<SpartanParseState>();
+    if(state != nullptr && state->trace_id == 0)
+        state = nullptr;
     // Drogon only accepts request from it's own event loops
-    app().getIOLoop(idx)->runInLoop([req=std::move(req), conn=std::move(conn), this](){
-        app().forward(req, [req=std::move(req), conn=std::move(conn), this](const HttpResponsePtr& resp){
-            sendResponseBack(conn, resp);
+    app().getIOLoop(idx)->runInLoop([req=std::move(req), conn=std::move(conn), state, this](){
+        if(state != nullptr)
+            tracing::step(state->trace_id, "dispatch", state->trace_mark);
+        app().forward(req, [req=std::move(req), conn=std::move(conn), state, this](const HttpResponsePtr& resp){
+            if(state != nullptr)
+                tracing::step(state->trace_id, "handler", state->trace_mark);
+            // Hop back to the connection's loop once. Sending from here would queue every send() and the
+            // shutdown() into the loop separately, each waking it up with a syscall
+            auto loop = conn->getLoop();
+            loop->runInLoop([conn, resp, this]() {
+                sendResponseBack(conn, resp);
+            });
         });
     });
 }
 
+std::shared_ptr<SpartanParseState> SpartanServer::newParseState(const TcpConnectionPtr& conn)
+{
+    auto pool = parseStatePools_.get(conn->getLoop());
+    if(pool == nullptr)
+        return std::make_shared<SpartanParseState>();
+    return pool->make();
+}
+
+PoolStats SpartanServer::parseStatePoolStats() const
+{
+    PoolStats stats;
+    parseStatePools_.forEach([&stats](EventLoop*, const ObjectPool<SpartanParseState>& pool) {
+        stats += pool.stats();
+    });
+    return stats;
+}
+
 void SpartanServer::onMessage(const TcpConnectionPtr &conn, MsgBuffer *buf)
 {
 	auto context = conn->getContext<SpartanParseState>();
-    if(context != nullptr) {
-        auto& [req, content_length, finished] = *context;
-		if(finished) {
+	// The state exists from accept on. Until the header is parsed it carries nothing but the timestamps
+    if(context != nullptr && (context->req != nullptr || context->request_finished)) {
+		if(context->request_finished) {
 			LOG_WARN << "Received more data than expected";
 			return;
 		}
-		if(buf->readableBytes() >= content_length) {
-			req->setParameter("query", std::string(buf->peek(), content_length));
-			finished = true;
-			processFinishedRequest(req, conn);
+		if(buf->readableBytes() >= context->content_length) {
+			context->req->setParameter("query", std::string(buf->peek(), context->content_length));
+			context->request_finished = true;
+			tracing::step(context->trace_id, "body", context->trace_mark);
+			processFinishedRequest(context->req, conn);
 		}
         return;
     }
@@ -91,7 +426,7 @@ void SpartanServer::onMessage(const TcpConnectionPtr &conn, MsgBuffer *buf)
 	auto crlf = buf->findCRLF();
 	if(crlf == nullptr)
 		return;
-	std::string header(buf->peek(), crlf);
+	std::string_view header(buf->peek(), std::distance(buf->peek(), crlf));
 	HttpRequestPtr req;
 	size_t content_length;
 	try {
@@ -99,40 +434,38 @@ void SpartanServer::onMessage(const TcpConnectionPtr &conn, MsgBuffer *buf)
 	}
 	catch(std::exception& e) {
 		LOG_WARN << "Invalid header: " << header;
-		auto resp = HttpResponse::newHttpResponse();
-        resp->setStatusCode(k500InternalServerError);
-        resp->addHeader("meta", "Invalid request header");
-        sendResponseBack(conn, resp);
+		// Remember the failure so the rest of the data is ignored and the request still gets logged
+		auto state = context != nullptr ? context : newParseState(conn);
+		state->request_finished = true;
+		conn->setContext(state);
+		sendHeaderOnly(conn, 4, "Invalid request header");
 		return;
 	}
 
-	buf->retrieve(std::distance(buf->peek(), crlf + 2));
 	LOG_TRACE << "Spartan request recived. Header: " << header;
+	buf->retrieve(std::distance(buf->peek(), crlf + 2));
 
-	SpartanParseState state;
-	state.req = req;
-	state.content_length = content_length;
+	auto state = context != nullptr ? context : newParseState(conn);
+	state->req = req;
+	state->content_length = content_length;
+	conn->setContext(state);
+	tracing::step(state->trace_id, "header", state->trace_mark);
 	if(content_length == 0) {
-		state.request_finished = true;
-		conn->setContext(std::make_shared<SpartanParseState>(state));
+		state->request_finished = true;
 		processFinishedRequest(req, conn);
 	}
-	else {
-		if(buf->readableBytes() >= content_length) {
-			req->setParameter("query", std::string(buf->peek(), content_length));
-			state.request_finished = true;
-			conn->setContext(std::make_shared<SpartanParseState>(state));
-			processFinishedRequest(req, conn);
-		}
-		else
-			conn->setContext(std::make_shared<SpartanParseState>(state));
+	else if(buf->readableBytes() >= content_length) {
+		req->setParameter("query", std::string(buf->peek(), content_length));
+		state->request_finished = true;
+		tracing::step(state->trace_id, "body", state->trace_mark);
+		processFinishedRequest(req, conn);
 	}
 }
 
 
 void SpartanServer::setIoLoopThreadPool(const std::shared_ptr<EventLoopThreadPool>& pool)
 {
-    server_.setIoLoopThreadPool(pool);
+    pool_ = pool;
 }
 
 void SpartanServer::sendResponseBack(const TcpConnectionPtr& conn, const HttpResponsePtr& resp)
@@ -156,11 +489,21 @@ void SpartanServer::sendResponseBack(const TcpConnectionPtr& conn, const HttpRes
     std::string respHeader;
     assert(status < 6 && status >= 2 || status >= 10 && status < 100);
 
+	auto state = conn->getContext<SpartanParseState>();
+	if(state != nullptr) {
+		state->status = status;
+		tracing::step(state->trace_id, "response hop", state->trace_mark);
+	}
+
 	// HACK: Gemini compatiblity hack: Send a custom redirection form
 	if(status/10 == 1) {
-		const auto& [req, _, __] = *conn->getContext<SpartanParseState>();
+		const auto& req = state->req;
 		auto meta = req->getHeader("meta");
-		std::string body = "=: " + req->path() + " " + (meta.empty() ? std::string("Input required") : meta);
+		std::string_view path = req->path();
+		// The client follows this link, which must not include the handler prefix of virtual hosts
+		if(state->vhost != nullptr)
+			path.remove_prefix(state->vhost->handlerPrefix.size());
+		std::string body = "=: " + std::string(path) + " " + (meta.empty() ? std::string("Input required") : meta);
 		conn->send("2 text/gemini\r\n" + body);
 		conn->shutdown();
 		return;
@@ -168,39 +511,48 @@ void SpartanServer::sendResponseBack(const TcpConnectionPtr& conn, const HttpRes
 
 	if(status == 2)
     {
-        auto ct = resp->contentTypeString();
-        if(ct != "")
-            respHeader = std::to_string(status) + " " + ct + "\r\n";
+        const auto& ct = resp->contentTypeString();
+        const std::string &sendfileName = resp->sendfileName();
+        const auto& body = resp->body();
+        // Header and body go out in one buffer, sized up front so building it is a single allocation
+        respHeader.reserve(32 + ct.size() + (sendfileName.empty() ? body.size() : 0));
+        respHeader += "2 ";
+        if(!ct.empty())
+            respHeader.append(ct.data(), ct.size());
+        else
+            respHeader += "application/octet-stream";
+        respHeader += "\r\n";
+        if (!sendfileName.empty())
+        {
+            conn->send(std::move(respHeader));
+            const auto &range = resp->sendfileRange();
+            conn->sendFile(sendfileName.c_str(), range.first, range.second);
+        }
         else
-            respHeader = std::to_string(status) + " application/octet-stream\r\n";
+        {
+            respHeader.append(body.data(), body.size());
+            conn->send(std::move(respHeader));
+        }
+        conn->shutdown();
+        return;
     }
-	else if(status == 3)
+
+	if(status == 3)
 	{
-		respHeader = std::to_string(status) + " " + resp->getHeader("Location") + "\r\n";
+		respHeader = "3 " + resp->getHeader("Location") + "\r\n";
 	}
 	else if(httpStatus == 404)
 	{
-		const auto& [req, _, __] = *conn->getContext<SpartanParseState>();
-		respHeader = "4 Path " + req->path() + " Not Found\r\n";
+		std::string_view path = state->req->path();
+		// Don't leak the handler prefix of virtual hosts
+		if(state->vhost != nullptr)
+			path.remove_prefix(state->vhost->handlerPrefix.size());
+		respHeader = "4 Path " + std::string(path) + " Not Found\r\n";
 	}
 	else
 	{
 		respHeader = "Spartoi encountered an error. HTTP status code: " + std::to_string(httpStatus) + "\r\n";
 	}
-    conn->send(respHeader);
-
-    if(status == 2)
-    {
-        const std::string &sendfileName = resp->sendfileName();
-        if (!sendfileName.empty())
-        {
-            const auto &range = resp->sendfileRange();
-            conn->sendFile(sendfileName.c_str(), range.first, range.second);
-        }
-        else if(resp->body().size() != 0)
-        {
-            conn->send(std::string(resp->body()));
-        }
-    }
+    conn->send(std::move(respHeader));
     conn->shutdown();
 }
@@ -2,7 +2,18 @@
 
 #include <drogon/HttpRequest.h>
 #include <drogon/utils/FunctionTraits.h>
+#include "AccessLog.hpp"
+#include "LoopStorage.hpp"
+#include "LoopbackConnection.hpp"
+#include "ObjectPool.hpp"
+#include "RateLimiter.hpp"
+#include "Tracing.hpp"
+#include "VirtualHost.hpp"
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <string_view>
+#include <vector>
 #include <trantor/net/EventLoop.h>
 #include <trantor/net/EventLoopThreadPool.h>
 #include <trantor/net/InetAddress.h>
@@ -12,33 +23,109 @@
 namespace spartoi
 {
 
+class UringLoop;
+
 struct SpartanParseState
 {
 	drogon::HttpRequestPtr req;
 	size_t content_length = 0;
 	bool request_finished = 0;
+	// Spartan status sent back to the client. 0 if no response was sent. Only touched by the connection's loop
+	int status = 0;
+	// When the connection was accepted
+	std::chrono::steady_clock::time_point start_time;
+	const VirtualHost* vhost = nullptr;
+	// Non-zero if the request is traced
+	uint64_t trace_id = 0;
+	tracing::Clock::time_point trace_start;
+	// End of the last recorded span
+	tracing::Clock::time_point trace_mark;
 };
 
 class SpartanServer : public trantor::NonCopyable
 {
 public:
+    enum class Transport
+    {
+        Trantor,
+        // Needs Linux 5.19 and spartoi built with SPARTOI_IO_URING. Falls back to Trantor otherwise
+        IoUring
+    };
+
     SpartanServer(
             trantor::EventLoop* loop,
             const trantor::InetAddress& listenAddr);
+    ~SpartanServer();
     void start();
     void setIoThreadNum(size_t n);
     void setIoLoopThreadPool(const std::shared_ptr<trantor::EventLoopThreadPool>& pool);
 
+    /**
+     * @brief Choose how connections are accepted and served. Must be called before start()
+     */
+    void setTransport(Transport transport);
+
+    /**
+     * @brief Limit how fast a single client can open connections. Connections over the limit are closed as soon as
+     *        they are accepted. Must be called before start()
+     *
+     *        Every IO loop enforces 1/N of the rate and burst (at least 1 connection of burst) without
+     *        coordinating with the others, N being the number of loops. A client never gets more than the limit, or
+     *        N if burst is below N. Since it's connections aren't spread perfectly evenly, it may be throttled
+     *        somewhat before reaching it.
+     */
+    void setRateLimit(const RateLimitConfig& config);
+
+    /**
+     * @brief Record every request into log. Must be called before start()
+     */
+    void setAccessLog(const std::shared_ptr<AccessLog>& log);
+
+    /**
+     * @brief Serve multiple hosts from this server. Requests for hosts not in hosts are rejected.
+     *        Must be called before start()
+     */
+    void setVirtualHosts(const std::shared_ptr<const VirtualHostMap>& hosts);
+
+    /**
+     * @brief Allocation counters of the per-loop parse state pools, summed over all loops.
+     */
+    PoolStats parseStatePoolStats() const;
+
+    /**
+     * @brief Open an in-memory connection to this server that goes through the same code paths as a TCP connection.
+     *        The returned end runs on clientLoop. Set it's callbacks, then call connectEstablished() on it.
+     *        Requires start() to be called first. Loopback connections are exempt from the rate limit.
+     */
+    std::shared_ptr<LoopbackConnection> connectLoopback(trantor::EventLoop* clientLoop);
+
 protected:
     void sendResponseBack(const trantor::TcpConnectionPtr& conn, const drogon::HttpResponsePtr& resp);
-    void onConnection(const trantor::TcpConnectionPtr &conn);
+    void onConnection(const trantor::TcpConnectionPtr &conn, bool rateLimited = true);
     void onMessage(const trantor::TcpConnectionPtr &conn, trantor::MsgBuffer *buf);
     trantor::EventLoop* loop_;
-    trantor::TcpServer server_;
+    trantor::InetAddress listenAddr_;
+    Transport transport_ = Transport::Trantor;
+    std::unique_ptr<trantor::TcpServer> server_;
+    std::vector<std::shared_ptr<UringLoop>> uringLoops_;
     std::atomic<int> roundRobbinIdx_{0};
+    std::shared_ptr<trantor::EventLoopThreadPool> pool_;
+
+    RateLimitConfig rateLimitConfig_;
+    LoopStorage<RateLimiter> rateLimiters_;
+    std::shared_ptr<AccessLog> accessLog_;
+    LoopStorage<AccessLog::Producer> accessLogProducers_;
+    std::shared_ptr<const VirtualHostMap> virtualHosts_;
+    LoopStorage<ObjectPool<SpartanParseState>> parseStatePools_;
+    std::vector<std::pair<trantor::EventLoop*, trantor::TimerId>> timers_;
 
-	std::pair<drogon::HttpRequestPtr, size_t> parseHeader(const std::string& header);
+	std::pair<drogon::HttpRequestPtr, size_t> parseHeader(std::string_view header);
+	std::shared_ptr<SpartanParseState> newParseState(const trantor::TcpConnectionPtr& conn);
 	void processFinishedRequest(const drogon::HttpRequestPtr& req, trantor::TcpConnectionPtr conn);
+	bool dispatchVirtualHost(const drogon::HttpRequestPtr& req, const trantor::TcpConnectionPtr& conn);
+	bool serveStaticFile(const VirtualHost& vhost, const std::string& path, const trantor::TcpConnectionPtr& conn);
+	void logAccess(const trantor::TcpConnectionPtr& conn);
+	bool startUring(const std::vector<trantor::EventLoop*>& loops);
 };
 
 }
@@ -3,14 +3,150 @@
 #include <drogon/HttpAppFramework.h>
 #include <drogon/utils/Utilities.h>
 #include <json/value.h>
+#include <charconv>
+#include <cstring>
+#include <fstream>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <trantor/net/EventLoopThreadPool.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 using namespace spartoi;
 using namespace drogon;
 using namespace trantor;
 
+static bool parseCpuNumber(std::string_view str, int& cpu)
+{
+    auto [end, err] = std::from_chars(str.data(), str.data() + str.size(), cpu);
+    return err == std::errc() && end == str.data() + str.size() && cpu >= 0;
+}
+
+// Parses the Linux cpulist format. ex: "0-3,8,10-11". Exits on malformed lists
+static std::vector<int> parseCpuList(const std::string& str)
+{
+    std::vector<int> cpus;
+    for(const auto& range : utils::splitString(str, ","))
+    {
+        std::string_view view = range;
+        auto dash = view.find('-');
+        int first;
+        int last;
+        if(!parseCpuNumber(view.substr(0, dash), first)
+            || !parseCpuNumber(dash == std::string_view::npos ? view : view.substr(dash + 1), last)
+            || last < first)
+        {
+            LOG_FATAL << "Invalid CPU list \"" << str << "\"";
+            exit(1);
+        }
+        for(int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static std::vector<int> numaNodeCpus(int node)
+{
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if(!in || !std::getline(in, list))
+    {
+        LOG_FATAL << "Cannot find CPUs of NUMA node " << node;
+        exit(1);
+    }
+    return parseCpuList(list);
+}
+
+static std::string cpusToString(const std::vector<int>& cpus)
+{
+    std::ostringstream ss;
+    for(size_t i = 0; i < cpus.size(); i++)
+        ss << (i == 0 ? "" : ",") << cpus[i];
+    return ss.str();
+}
+
+/**
+ * Pin the loops of pool according to config. With "cpuAffinity" (a list of CPUs or a cpulist string) every loop is
+ * pinned to a single CPU, round robin. With "numaNode" the loops may run on any CPU of that node, the kernel still
+ * balances them but they never leave the node's memory.
+ */
+static void pinLoops(const std::shared_ptr<EventLoopThreadPool>& pool, const std::string& name, const Json::Value& config)
+{
+    const auto& affinity = config["cpuAffinity"];
+    const auto& numaNode = config["numaNode"];
+    if(affinity.isNull() && numaNode.isNull())
+        return;
+    if(!affinity.isNull() && !numaNode.isNull())
+    {
+        LOG_FATAL << "cpuAffinity and numaNode of " << name << " can't be used together";
+        exit(1);
+    }
+#ifdef __linux__
+    std::vector<int> cpus;
+    bool perLoop = !affinity.isNull();
+    if(affinity.isString())
+        cpus = parseCpuList(affinity.asString());
+    else if(affinity.isArray())
+    {
+        for(const auto& cpu : affinity)
+        {
+            if(!cpu.isInt())
+            {
+                LOG_FATAL << "cpuAffinity of " << name << " must only contain CPU numbers";
+                exit(1);
+            }
+            cpus.push_back(cpu.asInt());
+        }
+    }
+    else if(affinity.isNull() && numaNode.isInt() && numaNode.asInt() >= 0)
+        cpus = numaNodeCpus(numaNode.asInt());
+    else
+    {
+        LOG_FATAL << (affinity.isNull() ? "numaNode of " + name + " must be a node number"
+            : "cpuAffinity of " + name + " must be a list of CPUs or a cpulist string");
+        exit(1);
+    }
+    if(cpus.empty())
+    {
+        LOG_FATAL << "No CPU to pin " << name << " to";
+        exit(1);
+    }
+    for(auto cpu : cpus)
+    {
+        if(cpu < 0 || cpu >= CPU_SETSIZE)
+        {
+            LOG_FATAL << "CPU " << cpu << " of " << name << " is out of range (0-" << CPU_SETSIZE - 1 << ")";
+            exit(1);
+        }
+    }
+
+    auto loops = pool->getLoops();
+    for(size_t i = 0; i < loops.size(); i++)
+    {
+        std::vector<int> loopCpus = perLoop ? std::vector<int>{cpus[i % cpus.size()]} : cpus;
+        // Affinity can only be set from the thread itself (or with it's pthread handle, which we don't have)
+        loops[i]->queueInLoop([loopCpus, name, i]() {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for(auto cpu : loopCpus)
+                CPU_SET(cpu, &set);
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if(err != 0)
+                LOG_ERROR << "Failed to pin " << name << " loop " << i << " to CPU " << cpusToString(loopCpus)
+                    << ": " << strerror(err);
+            else
+                LOG_INFO << name << " loop " << i << " pinned to CPU " << cpusToString(loopCpus);
+        });
+    }
+#else
+    LOG_WARN << "CPU pinning is only supported on Linux. Ignoring affinity settings of " << name;
+#endif
+}
+
 void SpartanServerPlugin::initAndStart(const Json::Value& config)
 {
     int numThread = config.get("numThread", 1).asInt();
@@ -21,7 +157,79 @@ void SpartanServerPlugin::initAndStart(const Json::Value& config)
     }
 
     pool_ = std::make_shared<trantor::EventLoopThreadPool>(numThread, "SpartanServerThreadPool");
+    pinLoops(pool_, "SpartanServerThreadPool", config);
 
+    const auto& accessLog = config["accessLog"];
+    if(!accessLog.isNull())
+    {
+        AccessLogConfig logConfig;
+        logConfig.path = accessLog.get("path", "").asString();
+        logConfig.maxFileSize = accessLog.get("maxFileSize", Json::UInt64(logConfig.maxFileSize)).asUInt64();
+        logConfig.maxFiles = accessLog.get("maxFiles", Json::UInt64(logConfig.maxFiles)).asUInt64();
+        logConfig.ringSize = accessLog.get("ringSize", Json::UInt64(logConfig.ringSize)).asUInt64();
+        logConfig.flushInterval = accessLog.get("flushInterval", logConfig.flushInterval).asDouble();
+        if(logConfig.path.empty())
+        {
+            LOG_FATAL << "accessLog.path must be specified";
+            exit(1);
+        }
+        accessLog_ = std::make_shared<AccessLog>(logConfig);
+        accessLog_->start();
+    }
+
+    const auto& tracingConfig = config["tracing"];
+    if(!tracingConfig.isNull())
+    {
+        TraceConfig traceConfig;
+        traceConfig.sampleRate = tracingConfig.get("sampleRate", traceConfig.sampleRate).asDouble();
+        traceConfig.eventsPerThread = tracingConfig.get("eventsPerThread"
+            , Json::UInt64(traceConfig.eventsPerThread)).asUInt64();
+        traceDumpPath_ = tracingConfig.get("dumpPath", "").asString();
+        if(traceConfig.sampleRate <= 0 || traceConfig.sampleRate > 1)
+        {
+            LOG_FATAL << "tracing.sampleRate must be in (0, 1]";
+            exit(1);
+        }
+        tracing::enable(traceConfig);
+    }
+
+    std::shared_ptr<VirtualHostMap> virtualHosts;
+    const auto& hostsConfig = config["virtualHosts"];
+    if(!hostsConfig.isNull())
+    {
+        virtualHosts = std::make_shared<VirtualHostMap>();
+        for(const auto& pattern : hostsConfig.getMemberNames())
+        {
+            const auto& hostConfig = hostsConfig[pattern];
+            VirtualHost host;
+            host.documentRoot = hostConfig.get("documentRoot", "").asString();
+            host.handlerPrefix = hostConfig.get("handlerPrefix", "").asString();
+            host.implicitPage = hostConfig.get("implicitPage", host.implicitPage).asString();
+            // Same format as Drogon's app.mime. MIME -> list of extensions
+            const auto& mimes = hostConfig["mime"];
+            for(const auto& mime : mimes.getMemberNames())
+            {
+                for(const auto& ext : mimes[mime])
+                    host.addMime(ext.asString(), mime);
+            }
+            // Like Drogon's file_types. Extensions static files may have
+            for(const auto& ext : hostConfig["fileTypes"])
+                host.addFileType(ext.asString());
+            if(!host.documentRoot.empty() && host.documentRoot.back() == '/')
+                host.documentRoot.pop_back();
+            if(!host.handlerPrefix.empty() && host.handlerPrefix.back() == '/')
+                host.handlerPrefix.pop_back();
+            try
+            {
+                virtualHosts->add(pattern, std::move(host));
+            }
+            catch(const std::exception& e)
+            {
+                LOG_FATAL << e.what();
+                exit(1);
+            }
+        }
+    }
 
     const auto& listeners = config["listeners"];
     if(listeners.isNull())
@@ -48,7 +256,50 @@ void SpartanServerPlugin::initAndStart(const Json::Value& config)
             }
 
             auto server = std::make_unique<SpartanServer>(app().getLoop(), addr);
-            server->setIoLoopThreadPool(pool_);
+            auto transport = listener.get("transport", "trantor").asString();
+            if(transport == "io_uring")
+                server->setTransport(SpartanServer::Transport::IoUring);
+            else if(transport != "trantor")
+            {
+                LOG_FATAL << "Unknown transport " << transport << " of listener " << addr.toIpPort()
+                    << ". Expected trantor or io_uring";
+                exit(1);
+            }
+            if(listener.isMember("numThread"))
+            {
+                // Dedicated loops so a busy listener can't starve the others
+                int listenerThreads = listener["numThread"].asInt();
+                if(listenerThreads < 1)
+                {
+                    LOG_FATAL << "numThread of listener " << addr.toIpPort() << " must be larger or equal to 1";
+                    exit(1);
+                }
+                std::string name = "SpartanServerThreadPool-" + addr.toIpPort();
+                auto pool = std::make_shared<EventLoopThreadPool>(listenerThreads, name);
+                pinLoops(pool, name, listener);
+                server->setIoLoopThreadPool(pool);
+                listenerPools_.push_back(pool);
+            }
+            else
+                server->setIoLoopThreadPool(pool_);
+            if(accessLog_)
+                server->setAccessLog(accessLog_);
+            if(virtualHosts)
+                server->setVirtualHosts(virtualHosts);
+            const auto& rateLimit = listener["rateLimit"];
+            if(!rateLimit.isNull())
+            {
+                RateLimitConfig limitConfig;
+                limitConfig.requestsPerSecond = rateLimit.get("requestsPerSecond", 0).asDouble();
+                limitConfig.burst = rateLimit.get("burst", limitConfig.requestsPerSecond).asDouble();
+                limitConfig.maxTrackedAddresses = rateLimit.get("maxTrackedAddresses", 65536).asUInt();
+                if(limitConfig.requestsPerSecond <= 0)
+                {
+                    LOG_FATAL << "rateLimit.requestsPerSecond must be larger than 0";
+                    exit(1);
+                }
+                server->setRateLimit(limitConfig);
+            }
             server->start();
             servers_.emplace_back(std::move(server));
         }
@@ -57,5 +308,27 @@ void SpartanServerPlugin::initAndStart(const Json::Value& config)
 
 void SpartanServerPlugin::shutdown()
 {
+    PoolStats stats;
+    for(const auto& server : servers_)
+        stats += server->parseStatePoolStats();
+    uint64_t total = stats.freshAllocations + stats.reusedAllocations;
+    if(total != 0)
+    {
+        LOG_INFO << "Spartan parse state allocations: " << total << " total, " << stats.freshAllocations
+            << " from the system allocator, " << stats.remoteFrees << " freed from other threads";
+    }
+    if(accessLog_)
+        accessLog_->stop();
+    if(!traceDumpPath_.empty())
+    {
+        try
+        {
+            tracing::dump(traceDumpPath_);
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR << e.what();
+        }
+    }
 }
 
@@ -5,6 +5,7 @@
 #include <drogon/plugins/Plugin.h>
 #include "SpartanServer.hpp"
 #include <memory>
+#include <string>
 #include <trantor/net/EventLoopThreadPool.h>
 #include <vector>
 
@@ -19,9 +20,21 @@ public:
     void initAndStart(const Json::Value &config) override;
     void shutdown() override;
 
+    /**
+     * @brief The running servers, one per listener in config order.
+     */
+    const std::vector<std::unique_ptr<SpartanServer>>& servers() const
+    {
+        return servers_;
+    }
+
 protected:
     std::shared_ptr<trantor::EventLoopThreadPool> pool_;
+    std::vector<std::shared_ptr<trantor::EventLoopThreadPool>> listenerPools_;
+    std::shared_ptr<AccessLog> accessLog_;
     std::vector<std::unique_ptr<SpartanServer>> servers_;
+    // Spans are written here on shutdown when tracing is configured
+    std::string traceDumpPath_;
 };
 }
 
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <trantor/utils/NonCopyable.h>
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace spartoi
+{
+
+/**
+ * @brief Bounded lock-free ring buffer for exactly one producer thread and one consumer thread.
+ */
+template <typename T>
+class SpscRing : public trantor::NonCopyable
+{
+public:
+    explicit SpscRing(size_t capacity)
+    {
+        size_t size = 1;
+        while(size < capacity)
+            size <<= 1;
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    /**
+     * @brief Producer side. Returns false without blocking if the ring is full.
+     */
+    bool push(const T& value)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - head_.load(std::memory_order_acquire) == slots_.size())
+            return false;
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Consumer side. Call func on every queued element, oldest first.
+     *
+     * @return number of elements consumed.
+     */
+    template <typename Func>
+    size_t drain(Func&& func)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        const size_t tail = tail_.load(std::memory_order_acquire);
+        for(size_t i = head; i != tail; i++)
+            func(slots_[i & mask_]);
+        head_.store(tail, std::memory_order_release);
+        return tail - head;
+    }
+
+    size_t capacity() const
+    {
+        return slots_.size();
+    }
+
+protected:
+    std::vector<T> slots_;
+    size_t mask_;
+    // Keep the indices on separate cache lines so producer and consumer don't fight over them
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+}
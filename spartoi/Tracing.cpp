@@ -0,0 +1,213 @@
+#include "Tracing.hpp"
+#include "JsonUtils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+using namespace spartoi;
+using namespace spartoi::tracing;
+using spartoi::internal::appendJsonString;
+
+namespace
+{
+
+struct Event
+{
+    uint64_t traceId;
+    const char* name;
+    // Nanoseconds on the steady clock
+    int64_t begin;
+    int64_t end;
+};
+
+struct ThreadBuffer
+{
+    // Only contended while dumping or clearing
+    std::mutex mutex;
+    std::vector<Event> events;
+    // Slot the next event overwrites once events is at capacity
+    size_t next = 0;
+    size_t capacity = 0;
+    size_t tid = 0;
+    std::string threadName;
+};
+
+std::mutex registryMutex;
+// Buffers outlive their threads so spans of exited threads still show up in dumps
+std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+std::atomic<size_t> eventsPerThread{TraceConfig().eventsPerThread};
+std::atomic<double> sampleRate{1.0};
+std::atomic<uint64_t> nextTraceId{1};
+
+thread_local std::shared_ptr<ThreadBuffer> localBuffer;
+thread_local double sampleCredit = 0;
+
+ThreadBuffer& threadBuffer()
+{
+    if(localBuffer)
+        return *localBuffer;
+
+    auto buffer = std::make_shared<ThreadBuffer>();
+    buffer->capacity = eventsPerThread.load(std::memory_order_relaxed);
+#ifdef __linux__
+    char name[16] = {};
+    if(pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+        buffer->threadName = name;
+#endif
+    std::lock_guard lock(registryMutex);
+    buffer->tid = buffers.size() + 1;
+    if(buffer->threadName.empty())
+        buffer->threadName = "thread " + std::to_string(buffer->tid);
+    buffers.push_back(buffer);
+    localBuffer = std::move(buffer);
+    return *localBuffer;
+}
+
+std::vector<std::shared_ptr<ThreadBuffer>> allBuffers()
+{
+    std::lock_guard lock(registryMutex);
+    return buffers;
+}
+
+int64_t toNanoseconds(Clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+}
+
+std::atomic<bool> tracing::internal::enabled{false};
+
+uint64_t tracing::internal::sample()
+{
+    double rate = sampleRate.load(std::memory_order_relaxed);
+    if(rate < 1)
+    {
+        // Deterministic 1 in 1/rate per thread. Cheaper than a random number and just as good for tracing
+        sampleCredit += rate;
+        if(sampleCredit < 1)
+            return 0;
+        sampleCredit -= 1;
+    }
+    return nextTraceId.fetch_add(1, std::memory_order_relaxed);
+}
+
+void tracing::internal::record(uint64_t traceId, const char* name, Clock::time_point begin, Clock::time_point end)
+{
+    auto& buffer = threadBuffer();
+    Event event{traceId, name, toNanoseconds(begin), toNanoseconds(end)};
+    std::lock_guard lock(buffer.mutex);
+    if(buffer.capacity == 0)
+        return;
+    if(buffer.events.size() < buffer.capacity)
+    {
+        buffer.events.push_back(event);
+        return;
+    }
+    buffer.events[buffer.next] = event;
+    buffer.next = (buffer.next + 1) % buffer.capacity;
+}
+
+void tracing::enable(const TraceConfig& config)
+{
+    sampleRate.store(std::clamp(config.sampleRate, 0.0, 1.0), std::memory_order_relaxed);
+    size_t previous = eventsPerThread.exchange(config.eventsPerThread, std::memory_order_relaxed);
+    if(previous != config.eventsPerThread)
+    {
+        for(const auto& buffer : allBuffers())
+        {
+            std::lock_guard lock(buffer->mutex);
+            buffer->capacity = config.eventsPerThread;
+            buffer->events.clear();
+            buffer->events.shrink_to_fit();
+            buffer->next = 0;
+        }
+    }
+    internal::enabled.store(true, std::memory_order_relaxed);
+}
+
+void tracing::disable()
+{
+    internal::enabled.store(false, std::memory_order_relaxed);
+}
+
+void tracing::clear()
+{
+    for(const auto& buffer : allBuffers())
+    {
+        std::lock_guard lock(buffer->mutex);
+        buffer->events.clear();
+        buffer->next = 0;
+    }
+}
+
+void tracing::dump(const std::string& path)
+{
+    struct ThreadEvents
+    {
+        size_t tid;
+        std::string name;
+        std::vector<Event> events;
+    };
+    std::vector<ThreadEvents> threads;
+    int64_t origin = INT64_MAX;
+    for(const auto& buffer : allBuffers())
+    {
+        ThreadEvents thread{buffer->tid, buffer->threadName, {}};
+        {
+            std::lock_guard lock(buffer->mutex);
+            thread.events = buffer->events;
+        }
+        for(const auto& event : thread.events)
+            origin = std::min(origin, event.begin);
+        threads.push_back(std::move(thread));
+    }
+
+    const int pid = getpid();
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char buf[192];
+    for(const auto& thread : threads)
+    {
+        if(!first)
+            out += ',';
+        first = false;
+        snprintf(buf, sizeof(buf), "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%zu,\"args\":{\"name\":"
+            , pid, thread.tid);
+        out += buf;
+        appendJsonString(out, thread.name);
+        out += "}}";
+
+        for(const auto& event : thread.events)
+        {
+            // Timestamps are microseconds relative to the earliest span so they stay readable
+            snprintf(buf, sizeof(buf), ",{\"ph\":\"X\",\"cat\":\"spartan\",\"pid\":%d,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f"
+                ",\"args\":{\"trace\":%llu},\"name\":", pid, thread.tid, (event.begin - origin) / 1000.0
+                , (event.end - event.begin) / 1000.0, static_cast<unsigned long long>(event.traceId));
+            out += buf;
+            appendJsonString(out, event.name);
+            out += '}';
+        }
+    }
+    out += "]}\n";
+
+    FILE* file = fopen(path.c_str(), "w");
+    if(file == nullptr)
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    ok = fclose(file) == 0 && ok;
+    if(!ok)
+        throw std::runtime_error("Failed to write " + path);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace spartoi
+{
+
+struct TraceConfig
+{
+    // Fraction of requests that get traced, between 0 and 1
+    double sampleRate = 1.0;
+    // Spans each thread keeps. The oldest ones are overwritten once full
+    size_t eventsPerThread = 65536;
+};
+
+/**
+ * @brief Request lifecycle tracing. Spans are recorded into a buffer owned by the recording thread and can be written
+ *        out as a Chrome trace (loadable in chrome://tracing and Perfetto) at any time.
+ *
+ *        A request is traced or not as a whole. newTrace() decides when it starts and returns 0 for requests that
+ *        aren't sampled. Every other call is a no-op for trace id 0, so untraced requests cost one relaxed atomic load.
+ */
+namespace tracing
+{
+
+using Clock = std::chrono::steady_clock;
+
+namespace internal
+{
+extern std::atomic<bool> enabled;
+uint64_t sample();
+void record(uint64_t traceId, const char* name, Clock::time_point begin, Clock::time_point end);
+}
+
+void enable(const TraceConfig& config = {});
+void disable();
+
+inline bool enabled()
+{
+    return internal::enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Id of a new trace, or 0 if tracing is off or the request isn't sampled.
+ */
+inline uint64_t newTrace()
+{
+    if(!enabled())
+        return 0;
+    return internal::sample();
+}
+
+/**
+ * @brief Record the span [begin, end] on the current thread. name must be a string literal (it's stored as a pointer).
+ */
+inline void span(uint64_t traceId, const char* name, Clock::time_point begin, Clock::time_point end)
+{
+    if(traceId != 0)
+        internal::record(traceId, name, begin, end);
+}
+
+/**
+ * @brief Record the span from mark to now and move mark to now. For consecutive phases of a request.
+ */
+inline void step(uint64_t traceId, const char* name, Clock::time_point& mark)
+{
+    if(traceId == 0)
+        return;
+    auto now = Clock::now();
+    internal::record(traceId, name, mark, now);
+    mark = now;
+}
+
+/**
+ * @brief Write every buffered span to path as Chrome trace JSON. Can be called while requests are being traced.
+ *        Throws std::runtime_error if the file can't be written.
+ */
+void dump(const std::string& path);
+
+/**
+ * @brief Drop all buffered spans.
+ */
+void clear();
+
+}
+
+}
@@ -0,0 +1,771 @@
+#include "UringTransport.hpp"
+#include <trantor/utils/Logger.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace spartoi;
+using namespace trantor;
+
+namespace
+{
+
+// Submission queue size of each ring. Completions get 4 times as many slots
+constexpr unsigned ringEntries = 256;
+// Spartan requests are a single short line, small receive buffers go a long way
+constexpr unsigned bufferCount = 1024;
+constexpr unsigned bufferSize = 2048;
+constexpr size_t fileChunkSize = 64 * 1024;
+constexpr uint64_t opMask = 7;
+
+InetAddress toInetAddress(const sockaddr_storage& addr)
+{
+    if(addr.ss_family == AF_INET6)
+        return InetAddress(reinterpret_cast<const sockaddr_in6&>(addr));
+    return InetAddress(reinterpret_cast<const sockaddr_in&>(addr));
+}
+
+}
+
+UringLoop::UringLoop(EventLoop* loop, const InetAddress& addr)
+    : loop_(loop), ring_(ringEntries)
+{
+    ring_.setupBufferRing(bufferGroup, bufferCount, bufferSize);
+
+    auto fail = [this](const std::string& what) {
+        std::runtime_error err(what + ": " + strerror(errno));
+        closeFds();
+        return err;
+    };
+    eventFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(eventFd_ < 0)
+        throw fail("eventfd");
+    ring_.registerEventFd(eventFd_);
+
+    // Every loop has it's own socket. The kernel spreads connections over them
+    const sockaddr* sockAddr = addr.getSockAddr();
+    listenFd_ = ::socket(sockAddr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(listenFd_ < 0)
+        throw fail("socket");
+    int on = 1;
+    ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    ::setsockopt(listenFd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    socklen_t len = addr.isIpV6() ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    if(::bind(listenFd_, sockAddr, len) < 0)
+        throw fail("Failed to bind " + addr.toIpPort());
+    if(::listen(listenFd_, SOMAXCONN) < 0)
+        throw fail("Failed to listen on " + addr.toIpPort());
+}
+
+UringLoop::~UringLoop()
+{
+    closeFds();
+}
+
+void UringLoop::closeFds()
+{
+    if(listenFd_ >= 0)
+        ::close(listenFd_);
+    if(eventFd_ >= 0)
+        ::close(eventFd_);
+    listenFd_ = eventFd_ = -1;
+}
+
+void UringLoop::start(ConnectionCallback connectionCallback, RecvMessageCallback messageCallback)
+{
+    connectionCallback_ = std::move(connectionCallback);
+    messageCallback_ = std::move(messageCallback);
+    channel_ = std::make_unique<Channel>(loop_, eventFd_);
+    channel_->setReadCallback([this]() { handleEvents(); });
+    channel_->enableReading();
+    armAccept();
+    ring_.submit();
+}
+
+void UringLoop::stop()
+{
+    if(stopping_ || channel_ == nullptr)
+        return;
+    stopping_ = true;
+    self_ = shared_from_this();
+    if(acceptArmed_)
+    {
+        io_uring_sqe* sqe = prepare(this, Cancel);
+        if(sqe != nullptr)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = reinterpret_cast<uintptr_t>(static_cast<UringHandler*>(this)) | Accept;
+        }
+    }
+
+    auto connections = std::vector<UringConnection*>(connections_.begin(), connections_.end());
+    for(auto conn : connections)
+    {
+        // The owner is going away, it must not hear about these
+        conn->connCallback_ = nullptr;
+        conn->messageCallback_ = nullptr;
+        conn->handleClose();
+    }
+    ring_.submit();
+    finishStop();
+}
+
+void UringLoop::finishStop()
+{
+    // Closed connections and the cancelled accept may still have completions on the way
+    if(!stopping_ || acceptArmed_ || !connections_.empty() || self_ == nullptr)
+        return;
+    channel_->disableAll();
+    channel_->remove();
+    // Not destroyed right here, this may run inside the channel's callback
+    loop_->queueInLoop([self = std::move(self_)]() {});
+}
+
+io_uring_sqe* UringLoop::prepare(UringHandler* handler, unsigned op)
+{
+    io_uring_sqe* sqe = ring_.getSqe();
+    if(sqe == nullptr)
+    {
+        LOG_ERROR << "io_uring submission queue is full";
+        return nullptr;
+    }
+    sqe->user_data = reinterpret_cast<uintptr_t>(handler) | op;
+    scheduleSubmit();
+    return sqe;
+}
+
+void UringLoop::scheduleSubmit()
+{
+    if(draining_ || submitQueued_)
+        return;
+    // Runs after everything already queued on the loop. Responses sent meanwhile share the syscall
+    submitQueued_ = true;
+    loop_->queueInLoop([self = shared_from_this()]() {
+        self->submitQueued_ = false;
+        self->ring_.submit();
+    });
+}
+
+void UringLoop::handleEvents()
+{
+    uint64_t count;
+    if(::read(eventFd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG_ERROR << "Failed to read io_uring eventfd: " << strerror(errno);
+
+    draining_ = true;
+    ring_.forEachCompletion([](const io_uring_cqe& cqe) {
+        auto handler = reinterpret_cast<UringHandler*>(cqe.user_data & ~opMask);
+        handler->handleCompletion(cqe.user_data & opMask, cqe);
+    });
+    draining_ = false;
+    ring_.submit();
+    finishStop();
+}
+
+void UringLoop::armAccept()
+{
+    io_uring_sqe* sqe = prepare(this, Accept);
+    if(sqe == nullptr)
+    {
+        loop_->runAfter(1.0, [self = shared_from_this()]() {
+            if(!self->stopping_ && !self->acceptArmed_)
+                self->armAccept();
+        });
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd_;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if(multishotAccept_)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    acceptArmed_ = true;
+}
+
+void UringLoop::handleCompletion(unsigned op, const io_uring_cqe& cqe)
+{
+    if(op != Accept)
+        return;
+    if(!(cqe.flags & IORING_CQE_F_MORE))
+        acceptArmed_ = false;
+
+    if(cqe.res >= 0)
+    {
+        int fd = cqe.res;
+        if(stopping_)
+        {
+            ::close(fd);
+            return;
+        }
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if(::getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+        {
+            // Already gone
+            ::close(fd);
+        }
+        else
+        {
+            auto conn = std::make_shared<UringConnection>(shared_from_this(), fd, toInetAddress(addr));
+            connections_.insert(conn.get());
+            conn->connectEstablished(connectionCallback_, messageCallback_);
+        }
+    }
+    else if(cqe.res == -EINVAL && multishotAccept_ && !stopping_)
+    {
+        // Before Linux 5.19. One accept per submission
+        multishotAccept_ = false;
+    }
+    else if(cqe.res != -ECANCELED)
+    {
+        LOG_ERROR << "accept failed: " << strerror(-cqe.res);
+        if(!acceptArmed_ && !stopping_)
+        {
+            // Most likely out of file descriptors. Give connections some time to close instead of spinning
+            loop_->runAfter(1.0, [self = shared_from_this()]() {
+                if(!self->stopping_ && !self->acceptArmed_)
+                    self->armAccept();
+            });
+        }
+        return;
+    }
+
+    if(!acceptArmed_ && !stopping_)
+        armAccept();
+}
+
+void UringLoop::removeConnection(UringConnection* conn)
+{
+    connections_.erase(conn);
+}
+
+UringConnection::UringConnection(const std::shared_ptr<UringLoop>& uring, int fd, const InetAddress& peerAddr)
+    : uring_(uring), fd_(fd), peerAddr_(peerAddr)
+{
+}
+
+UringConnection::~UringConnection()
+{
+    for(const auto& pending : writeQueue_)
+    {
+        if(pending.fileFd >= 0)
+            ::close(pending.fileFd);
+    }
+    if(fd_ >= 0)
+        ::close(fd_);
+}
+
+void UringConnection::connectEstablished(ConnectionCallback connectionCallback, RecvMessageCallback messageCallback)
+{
+    connCallback_ = std::move(connectionCallback);
+    messageCallback_ = std::move(messageCallback);
+    self_ = shared_from_this();
+    if(connCallback_)
+        connCallback_(self_);
+    // The callback may have closed the connection right away
+    if(status_ != Status::Disconnected)
+        armRecv();
+}
+
+void UringConnection::armRecv()
+{
+    io_uring_sqe* sqe = uring_->prepare(this, Recv);
+    if(sqe == nullptr)
+    {
+        handleClose();
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd_;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UringLoop::bufferGroup;
+    if(multishotRecv_)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    inFlight_++;
+    recvArmed_ = true;
+}
+
+void UringConnection::handleCompletion(unsigned op, const io_uring_cqe& cqe)
+{
+    // Callbacks may drop every other reference
+    auto thisPtr = shared_from_this();
+    if(op == Recv)
+    {
+        // A multishot receive stays in flight until the kernel says otherwise
+        if(!(cqe.flags & IORING_CQE_F_MORE))
+            inFlight_--;
+        handleRecv(cqe);
+    }
+    else
+    {
+        inFlight_--;
+        if(op == Send)
+            handleSend(cqe);
+        else if(op == ReadFile)
+            handleReadFile(cqe);
+        else if(op == Shutdown && cqe.res == -ECANCELED)
+        {
+            // The send it was linked to came up short. Goes out again after the rest of the data
+            shutdownSubmitted_ = false;
+            if(!writing_ && status_ != Status::Disconnected)
+                writeNext();
+        }
+    }
+    tryRelease();
+}
+
+void UringConnection::handleRecv(const io_uring_cqe& cqe)
+{
+    if(!(cqe.flags & IORING_CQE_F_MORE))
+        recvArmed_ = false;
+
+    if(cqe.res > 0)
+    {
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        IoUring& ring = uring_->ring();
+        if(status_ != Status::Disconnected)
+        {
+            recvBuffer_.append(ring.buffer(bid), cqe.res);
+            bytesReceived_ += cqe.res;
+        }
+        ring.recycleBuffer(bid);
+        if(status_ != Status::Disconnected && messageCallback_)
+            messageCallback_(shared_from_this(), &recvBuffer_);
+    }
+    else if(cqe.res == 0)
+    {
+        // EOF
+        handleClose();
+        return;
+    }
+    else if(cqe.res == -EINVAL && multishotRecv_)
+    {
+        // Multishot receives need Linux 6.0. Fall back to one receive per submission
+        multishotRecv_ = false;
+    }
+    else if(cqe.res != -ENOBUFS)
+    {
+        // ENOBUFS only means every buffer is in use, they are back by the time the receive is armed again
+        if(cqe.res != -ECANCELED && cqe.res != -ECONNRESET)
+            LOG_DEBUG << "recv failed: " << strerror(-cqe.res);
+        handleClose();
+        return;
+    }
+
+    if(!recvArmed_ && status_ != Status::Disconnected)
+        armRecv();
+}
+
+void UringConnection::send(const char* msg, size_t len)
+{
+    send(std::string(msg, len));
+}
+
+void UringConnection::send(const void* msg, size_t len)
+{
+    send(std::string(static_cast<const char*>(msg), len));
+}
+
+void UringConnection::send(const std::string& msg)
+{
+    send(std::string(msg));
+}
+
+void UringConnection::send(std::string&& msg)
+{
+    EventLoop* loop = uring_->loop();
+    if(loop->isInLoopThread())
+    {
+        sendInLoop(std::move(msg));
+        return;
+    }
+    loop->queueInLoop([thisPtr = shared_from_this(), msg = std::move(msg)]() mutable {
+        thisPtr->sendInLoop(std::move(msg));
+    });
+}
+
+void UringConnection::send(const MsgBuffer& buffer)
+{
+    send(std::string(buffer.peek(), buffer.readableBytes()));
+}
+
+void UringConnection::send(MsgBuffer&& buffer)
+{
+    send(std::string(buffer.peek(), buffer.readableBytes()));
+}
+
+void UringConnection::send(const std::shared_ptr<std::string>& msgPtr)
+{
+    send(*msgPtr);
+}
+
+void UringConnection::send(const std::shared_ptr<MsgBuffer>& msgPtr)
+{
+    send(*msgPtr);
+}
+
+void UringConnection::sendInLoop(std::string&& data)
+{
+    if(status_ != Status::Connected || shutdownRequested_)
+    {
+        LOG_DEBUG << "Connection is closing. Dropping " << data.size() << " bytes";
+        return;
+    }
+    if(data.empty())
+        return;
+    writeQueue_.push_back(Pending{std::move(data)});
+    if(!writing_)
+        writeNext();
+}
+
+void UringConnection::sendFile(const char* fileName, long long offset, long long length)
+{
+    int fd = ::open(fileName, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        LOG_ERROR << "Can't open " << fileName << ": " << strerror(errno);
+        return;
+    }
+    if(length <= 0)
+    {
+        // The rest of the file
+        struct stat st;
+        if(::fstat(fd, &st) < 0)
+        {
+            LOG_ERROR << "Can't stat " << fileName << ": " << strerror(errno);
+            ::close(fd);
+            return;
+        }
+        length = std::max<long long>(st.st_size - offset, 0);
+    }
+
+    EventLoop* loop = uring_->loop();
+    if(loop->isInLoopThread())
+    {
+        sendFileInLoop(fd, offset, length);
+        return;
+    }
+    loop->queueInLoop([thisPtr = shared_from_this(), fd, offset, length]() {
+        thisPtr->sendFileInLoop(fd, offset, length);
+    });
+}
+
+void UringConnection::sendFile(const wchar_t* fileName, long long offset, long long length)
+{
+    sendFile(std::filesystem::path(fileName).c_str(), offset, length);
+}
+
+void UringConnection::sendFileInLoop(int fd, long long offset, long long length)
+{
+    if(status_ != Status::Connected || shutdownRequested_ || length == 0)
+    {
+        ::close(fd);
+        return;
+    }
+    Pending pending;
+    pending.fileFd = fd;
+    pending.fileOffset = offset;
+    pending.fileRemaining = length;
+    writeQueue_.push_back(std::move(pending));
+    if(!writing_)
+        writeNext();
+}
+
+void UringConnection::sendStream(std::function<std::size_t(char*, std::size_t)> callback)
+{
+    char buffer[16 * 1024];
+    for(size_t n = callback(buffer, sizeof(buffer)); n != 0; n = callback(buffer, sizeof(buffer)))
+        send(buffer, n);
+    // Tell the stream we are done, same as trantor
+    callback(nullptr, 0);
+}
+
+void UringConnection::writeNext()
+{
+    // One write in flight at a time keeps the data in order
+    writing_ = false;
+    while(!writeQueue_.empty())
+    {
+        Pending& front = writeQueue_.front();
+        if(front.sent == front.data.size())
+        {
+            if(front.fileFd < 0 || front.fileRemaining == 0)
+            {
+                if(front.fileFd >= 0)
+                    ::close(front.fileFd);
+                writeQueue_.pop_front();
+                continue;
+            }
+
+            // Read the next chunk of the file. It's sent once the read completes
+            io_uring_sqe* sqe = uring_->prepare(this, ReadFile);
+            if(sqe == nullptr)
+            {
+                handleClose();
+                return;
+            }
+            front.data.resize(std::min<long long>(front.fileRemaining, fileChunkSize));
+            front.sent = 0;
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = front.fileFd;
+            sqe->addr = reinterpret_cast<uint64_t>(front.data.data());
+            sqe->len = front.data.size();
+            sqe->off = front.fileOffset;
+            inFlight_++;
+            writing_ = true;
+            return;
+        }
+
+        bool last = writeQueue_.size() == 1 && front.fileRemaining == 0;
+        bool linkShutdown = last && shutdownRequested_ && !shutdownSubmitted_;
+        // Linked entries only stay linked if they reach the kernel in the same submit
+        if(linkShutdown && uring_->ring().spaceLeft() < 2)
+            uring_->ring().submit();
+        io_uring_sqe* sqe = uring_->prepare(this, Send);
+        if(sqe == nullptr)
+        {
+            handleClose();
+            return;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(front.data.data() + front.sent);
+        sqe->len = front.data.size() - front.sent;
+        // Without MSG_WAITALL a short send would break the link to the shutdown
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        inFlight_++;
+        writing_ = true;
+        if(linkShutdown)
+        {
+            // The kernel shuts the socket down right after the data is out. No extra round trip through the loop
+            sqe->flags |= IOSQE_IO_LINK;
+            submitShutdown();
+        }
+        return;
+    }
+
+    if(shutdownRequested_ && !shutdownSubmitted_)
+        submitShutdown();
+}
+
+void UringConnection::handleSend(const io_uring_cqe& cqe)
+{
+    writing_ = false;
+    if(cqe.res < 0)
+    {
+        if(cqe.res != -EPIPE && cqe.res != -ECONNRESET && cqe.res != -ECANCELED)
+            LOG_DEBUG << "send failed: " << strerror(-cqe.res);
+        handleClose();
+        return;
+    }
+    bytesSent_ += cqe.res;
+    if(!writeQueue_.empty())
+        writeQueue_.front().sent += cqe.res;
+    if(status_ != Status::Disconnected)
+        writeNext();
+}
+
+void UringConnection::handleReadFile(const io_uring_cqe& cqe)
+{
+    writing_ = false;
+    if(status_ == Status::Disconnected || writeQueue_.empty())
+        return;
+    Pending& front = writeQueue_.front();
+    if(cqe.res < 0)
+    {
+        LOG_ERROR << "Failed to read file: " << strerror(-cqe.res);
+        handleClose();
+        return;
+    }
+    if(cqe.res == 0)
+    {
+        // The file got shorter since it was queued. Send what's there
+        front.fileRemaining = 0;
+        front.data.clear();
+    }
+    else
+    {
+        front.data.resize(cqe.res);
+        front.fileOffset += cqe.res;
+        front.fileRemaining -= cqe.res;
+    }
+    writeNext();
+}
+
+void UringConnection::submitShutdown()
+{
+    io_uring_sqe* sqe = uring_->prepare(this, Shutdown);
+    if(sqe == nullptr)
+    {
+        handleClose();
+        return;
+    }
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = fd_;
+    sqe->len = SHUT_WR;
+    inFlight_++;
+    shutdownSubmitted_ = true;
+}
+
+void UringConnection::shutdownInLoop()
+{
+    if(status_ != Status::Connected)
+        return;
+    status_ = Status::Disconnecting;
+    shutdownRequested_ = true;
+    // Otherwise the shutdown is linked to the last send
+    if(!writing_)
+        writeNext();
+}
+
+void UringConnection::shutdown()
+{
+    uring_->loop()->runInLoop([thisPtr = shared_from_this()]() {
+        thisPtr->shutdownInLoop();
+    });
+}
+
+void UringConnection::forceClose()
+{
+    uring_->loop()->runInLoop([thisPtr = shared_from_this()]() {
+        thisPtr->handleClose();
+    });
+}
+
+void UringConnection::handleClose()
+{
+    if(status_ == Status::Disconnected)
+        return;
+    status_ = Status::Disconnected;
+    // Completes whatever is still in flight on the socket. The descriptor is closed once the kernel is done with it
+    ::shutdown(fd_, SHUT_RDWR);
+    // The kernel may still be reading from or writing into the front buffer. It goes with the connection
+    size_t keep = writing_ ? 1 : 0;
+    while(writeQueue_.size() > keep)
+    {
+        if(writeQueue_.back().fileFd >= 0)
+            ::close(writeQueue_.back().fileFd);
+        writeQueue_.pop_back();
+    }
+
+    auto thisPtr = shared_from_this();
+    if(connCallback_)
+        connCallback_(thisPtr);
+    tryRelease();
+}
+
+void UringConnection::tryRelease()
+{
+    if(status_ != Status::Disconnected || inFlight_ != 0 || self_ == nullptr)
+        return;
+    ::close(fd_);
+    fd_ = -1;
+    uring_->removeConnection(this);
+    self_.reset();
+}
+
+const InetAddress& UringConnection::localAddr() const
+{
+    if(!localAddrKnown_)
+    {
+        // Rarely needed, not worth a syscall on every accept
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if(fd_ >= 0 && ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) == 0)
+        {
+            localAddr_ = toInetAddress(addr);
+            localAddrKnown_ = true;
+        }
+    }
+    return localAddr_;
+}
+
+const InetAddress& UringConnection::peerAddr() const
+{
+    return peerAddr_;
+}
+
+bool UringConnection::connected() const
+{
+    return status_ == Status::Connected;
+}
+
+bool UringConnection::disconnected() const
+{
+    return status_ == Status::Disconnected;
+}
+
+MsgBuffer* UringConnection::getRecvBuffer()
+{
+    return &recvBuffer_;
+}
+
+void UringConnection::setHighWaterMarkCallback(const HighWaterMarkCallback&, size_t)
+{
+    // Files are read a chunk at a time right before they are sent, nothing else piles up on the server
+}
+
+void UringConnection::setTcpNoDelay(bool on)
+{
+    int optval = on ? 1 : 0;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
+EventLoop* UringConnection::getLoop()
+{
+    return uring_->loop();
+}
+
+void UringConnection::keepAlive()
+{
+}
+
+bool UringConnection::isKeepAlive()
+{
+    return false;
+}
+
+size_t UringConnection::bytesSent() const
+{
+    return bytesSent_;
+}
+
+size_t UringConnection::bytesReceived() const
+{
+    return bytesReceived_;
+}
+
+bool UringConnection::isSSLConnection() const
+{
+    return false;
+}
+
+void UringConnection::startEncryption(TLSPolicyPtr, bool, std::function<void(const TcpConnectionPtr&)>)
+{
+    LOG_ERROR << "io_uring connections don't support TLS";
+}
+
+std::string UringConnection::applicationProtocol() const
+{
+    return "";
+}
+
+CertificatePtr UringConnection::peerCertificate() const
+{
+    return nullptr;
+}
+
+std::string UringConnection::sniName() const
+{
+    return "";
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "IoUring.hpp"
+
+#include <trantor/net/Certificate.h>
+#include <trantor/net/Channel.h>
+#include <trantor/net/EventLoop.h>
+#include <trantor/net/InetAddress.h>
+#include <trantor/net/TLSPolicy.h>
+#include <trantor/net/TcpConnection.h>
+#include <trantor/net/callbacks.h>
+#include <trantor/utils/MsgBuffer.h>
+#include <trantor/utils/NonCopyable.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+namespace spartoi
+{
+
+class UringConnection;
+
+/**
+ * @brief Anything that has operations in flight on an io_uring. The low bits of a submission's user_data say which
+ *        operation completed, the rest is the handler.
+ */
+struct UringHandler
+{
+    virtual ~UringHandler() = default;
+    virtual void handleCompletion(unsigned op, const io_uring_cqe& cqe) = 0;
+};
+
+/**
+ * @brief io_uring based replacement for trantor's acceptor and socket IO on one event loop. The ring signals an
+ *        eventfd watched by the loop, so timers, runInLoop() and the rest of trantor keep working as usual.
+ *
+ *        Accepts with a multishot accept on it's own SO_REUSEPORT socket, receives into provided buffers with
+ *        multishot receives and closes the write side with a shutdown linked to the last send. Every submission
+ *        made during a loop iteration goes to the kernel in a single syscall.
+ *
+ *        Everything but the constructor must be called from the loop's thread. Stays alive until stop() finished
+ *        closing every connection.
+ */
+class UringLoop : public UringHandler
+    , public std::enable_shared_from_this<UringLoop>
+    , public trantor::NonCopyable
+{
+public:
+    /**
+     * @brief Sets up the ring and binds a listening socket to addr. Throws std::runtime_error if the kernel lacks what
+     *        the transport needs (io_uring with buffer rings, Linux 5.19) or the socket can't be set up.
+     */
+    UringLoop(trantor::EventLoop* loop, const trantor::InetAddress& addr);
+    ~UringLoop() override;
+
+    /**
+     * @brief Start accepting. New connections get the callbacks, just like with trantor::TcpServer.
+     */
+    void start(trantor::ConnectionCallback connectionCallback, trantor::RecvMessageCallback messageCallback);
+
+    /**
+     * @brief Stop accepting and close every connection without calling back into the owner.
+     */
+    void stop();
+
+    trantor::EventLoop* loop() const
+    {
+        return loop_;
+    }
+
+    /**
+     * @brief A submission entry tagged for handler. Goes to the kernel with the next flush, at the latest at the end
+     *        of the current loop iteration.
+     */
+    io_uring_sqe* prepare(UringHandler* handler, unsigned op);
+
+    IoUring& ring()
+    {
+        return ring_;
+    }
+
+    static constexpr uint16_t bufferGroup = 0;
+
+    void handleCompletion(unsigned op, const io_uring_cqe& cqe) override;
+
+protected:
+    friend class UringConnection;
+
+    enum Op : unsigned
+    {
+        Accept,
+        Cancel
+    };
+
+    void handleEvents();
+    void scheduleSubmit();
+    void armAccept();
+    void removeConnection(UringConnection* conn);
+    void closeFds();
+    void finishStop();
+
+    trantor::EventLoop* loop_;
+    IoUring ring_;
+    int eventFd_ = -1;
+    std::unique_ptr<trantor::Channel> channel_;
+    int listenFd_ = -1;
+    bool multishotAccept_ = true;
+    bool acceptArmed_ = false;
+    // Completions are being handled. Whatever they submit is flushed once they are all done
+    bool draining_ = false;
+    bool submitQueued_ = false;
+    bool stopping_ = false;
+    // Keeps the loop alive until stop() is done with the ring
+    std::shared_ptr<UringLoop> self_;
+    trantor::ConnectionCallback connectionCallback_;
+    trantor::RecvMessageCallback messageCallback_;
+    std::unordered_set<UringConnection*> connections_;
+};
+
+/**
+ * @brief A TCP connection driven by a UringLoop. Implements the TcpConnection interface of trantor 1.5, minus TLS.
+ */
+class UringConnection : public trantor::TcpConnection
+    , public UringHandler
+    , public std::enable_shared_from_this<UringConnection>
+{
+public:
+    UringConnection(const std::shared_ptr<UringLoop>& uring, int fd, const trantor::InetAddress& peerAddr);
+    ~UringConnection() override;
+
+    void send(const char* msg, size_t len) override;
+    void send(const void* msg, size_t len) override;
+    void send(const std::string& msg) override;
+    void send(std::string&& msg) override;
+    void send(const trantor::MsgBuffer& buffer) override;
+    void send(trantor::MsgBuffer&& buffer) override;
+    void send(const std::shared_ptr<std::string>& msgPtr) override;
+    void send(const std::shared_ptr<trantor::MsgBuffer>& msgPtr) override;
+    void sendFile(const char* fileName, long long offset = 0, long long length = 0) override;
+    void sendFile(const wchar_t* fileName, long long offset = 0, long long length = 0) override;
+    void sendStream(std::function<std::size_t(char*, std::size_t)> callback) override;
+    const trantor::InetAddress& localAddr() const override;
+    const trantor::InetAddress& peerAddr() const override;
+    bool connected() const override;
+    bool disconnected() const override;
+    trantor::MsgBuffer* getRecvBuffer() override;
+    void setHighWaterMarkCallback(const trantor::HighWaterMarkCallback& cb, size_t markLen) override;
+    void setTcpNoDelay(bool on) override;
+    void shutdown() override;
+    void forceClose() override;
+    trantor::EventLoop* getLoop() override;
+    void keepAlive() override;
+    bool isKeepAlive() override;
+    size_t bytesSent() const override;
+    size_t bytesReceived() const override;
+    bool isSSLConnection() const override;
+    void startEncryption(trantor::TLSPolicyPtr policy, bool isServer
+        , std::function<void(const trantor::TcpConnectionPtr&)> upgradeCallback = nullptr) override;
+    std::string applicationProtocol() const override;
+    trantor::CertificatePtr peerCertificate() const override;
+    std::string sniName() const override;
+
+    void handleCompletion(unsigned op, const io_uring_cqe& cqe) override;
+
+protected:
+    friend class UringLoop;
+
+    enum Op : unsigned
+    {
+        Recv,
+        Send,
+        ReadFile,
+        Shutdown
+    };
+
+    enum class Status
+    {
+        Connected,
+        Disconnecting,
+        Disconnected
+    };
+
+    // Either bytes to send or a range of a file, read in chunks right before they are sent
+    struct Pending
+    {
+        std::string data;
+        size_t sent = 0;
+        int fileFd = -1;
+        long long fileOffset = 0;
+        long long fileRemaining = 0;
+    };
+
+    void connectEstablished(trantor::ConnectionCallback connectionCallback
+        , trantor::RecvMessageCallback messageCallback);
+    void armRecv();
+    void sendInLoop(std::string&& data);
+    void sendFileInLoop(int fd, long long offset, long long length);
+    void writeNext();
+    void submitShutdown();
+    void shutdownInLoop();
+    void handleRecv(const io_uring_cqe& cqe);
+    void handleSend(const io_uring_cqe& cqe);
+    void handleReadFile(const io_uring_cqe& cqe);
+    void handleClose();
+    void tryRelease();
+
+    std::shared_ptr<UringLoop> uring_;
+    int fd_;
+    trantor::InetAddress peerAddr_;
+    mutable trantor::InetAddress localAddr_;
+    mutable bool localAddrKnown_ = false;
+    // Keeps the connection alive while it's open or the kernel still holds pointers to it
+    std::shared_ptr<UringConnection> self_;
+    Status status_ = Status::Connected;
+    unsigned inFlight_ = 0;
+    bool recvArmed_ = false;
+    bool multishotRecv_ = true;
+    bool writing_ = false;
+    bool shutdownRequested_ = false;
+    bool shutdownSubmitted_ = false;
+    std::deque<Pending> writeQueue_;
+    trantor::MsgBuffer recvBuffer_;
+    size_t bytesSent_ = 0;
+    size_t bytesReceived_ = 0;
+    trantor::ConnectionCallback connCallback_;
+    trantor::RecvMessageCallback messageCallback_;
+};
+
+}
@@ -0,0 +1,157 @@
+#include "VirtualHost.hpp"
+
+#include <cctype>
+#include <stdexcept>
+
+using namespace spartoi;
+
+size_t CaseInsensitiveHash::operator()(std::string_view str) const
+{
+    // FNV-1a
+    size_t hash = 14695981039346656037ULL;
+    for(char c : str)
+    {
+        hash ^= (unsigned char)std::tolower((unsigned char)c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool CaseInsensitiveEqual::operator()(std::string_view a, std::string_view b) const
+{
+    if(a.size() != b.size())
+        return false;
+    for(size_t i = 0; i < a.size(); i++)
+    {
+        if(std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i]))
+            return false;
+    }
+    return true;
+}
+
+void VirtualHost::addMime(std::string extension, std::string mime)
+{
+    std::string_view ext = strings.emplace_back(std::move(extension));
+    std::string_view type = strings.emplace_back(std::move(mime));
+    mimes[ext] = type;
+}
+
+void VirtualHost::addFileType(std::string extension)
+{
+    fileTypes.insert(strings.emplace_back(std::move(extension)));
+}
+
+void VirtualHostMap::add(const std::string& pattern, VirtualHost host)
+{
+    host.name = pattern;
+    // The map keys point into the stored name, which never moves
+    const VirtualHost* stored = &hosts_.emplace_back(std::move(host));
+    std::string_view name = stored->name;
+
+    bool inserted = true;
+    if(name == "*")
+    {
+        inserted = default_ == nullptr;
+        if(inserted)
+            default_ = stored;
+    }
+    else if(name.substr(0, 2) == "*.")
+        inserted = wildcard_.emplace(name.substr(2), stored).second;
+    else
+        inserted = exact_.emplace(name, stored).second;
+
+    if(!inserted)
+    {
+        hosts_.pop_back();
+        throw std::invalid_argument("Duplicated virtual host " + pattern);
+    }
+}
+
+const VirtualHost* VirtualHostMap::find(std::string_view host) const
+{
+    if(!host.empty() && host.back() == '.')
+        host.remove_suffix(1);
+
+    auto it = exact_.find(host);
+    if(it != exact_.end())
+        return it->second;
+
+    if(!wildcard_.empty())
+    {
+        // Try every parent domain, longest first. A wildcard never matches the bare domain itself
+        for(auto dot = host.find('.'); dot != std::string_view::npos; dot = host.find('.', dot + 1))
+        {
+            it = wildcard_.find(host.substr(dot + 1));
+            if(it != wildcard_.end())
+                return it->second;
+        }
+    }
+    return default_;
+}
+
+using MimeTable = std::unordered_map<std::string_view, std::string_view, CaseInsensitiveHash, CaseInsensitiveEqual>;
+
+static const MimeTable& builtinMimes()
+{
+    static const MimeTable builtin{
+        {"gmi", "text/gemini"},
+        {"gemini", "text/gemini"},
+        {"txt", "text/plain"},
+        {"md", "text/markdown"},
+        {"html", "text/html"},
+        {"htm", "text/html"},
+        {"css", "text/css"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"xml", "application/xml"},
+        {"pdf", "application/pdf"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"webp", "image/webp"},
+        {"svg", "image/svg+xml"},
+        {"mp3", "audio/mpeg"},
+        {"ogg", "audio/ogg"},
+        {"zip", "application/zip"}};
+    return builtin;
+}
+
+// Empty if the file has no extension
+static std::string_view extensionOf(std::string_view path)
+{
+    auto dot = path.rfind('.');
+    auto slash = path.rfind('/');
+    if(dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash))
+        return {};
+    return path.substr(dot + 1);
+}
+
+std::string_view spartoi::mimeOfFile(const VirtualHost& host, std::string_view path)
+{
+    std::string_view ext = extensionOf(path);
+    if(ext.empty())
+        return "application/octet-stream";
+
+    if(!host.mimes.empty())
+    {
+        auto it = host.mimes.find(ext);
+        if(it != host.mimes.end())
+            return it->second;
+    }
+    const auto& builtin = builtinMimes();
+    auto it = builtin.find(ext);
+    if(it != builtin.end())
+        return it->second;
+    return "application/octet-stream";
+}
+
+bool spartoi::isServedFileType(const VirtualHost& host, std::string_view path)
+{
+    std::string_view ext = extensionOf(path);
+    if(ext.empty())
+        return false;
+    if(!host.fileTypes.empty())
+        return host.fileTypes.count(ext) != 0;
+    return host.mimes.count(ext) != 0 || builtinMimes().count(ext) != 0;
+}
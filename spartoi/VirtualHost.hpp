@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace spartoi
+{
+
+/**
+ * @brief Hash and equality of ASCII case insensitive string_view keys. Lookups never copy the key.
+ */
+struct CaseInsensitiveHash
+{
+    size_t operator()(std::string_view str) const;
+};
+
+struct CaseInsensitiveEqual
+{
+    bool operator()(std::string_view a, std::string_view b) const;
+};
+
+struct VirtualHost
+{
+    VirtualHost() = default;
+    VirtualHost(VirtualHost&&) = default;
+    VirtualHost& operator=(VirtualHost&&) = default;
+    // mimes and fileTypes point into strings, a copy would point into the original
+    VirtualHost(const VirtualHost&) = delete;
+    VirtualHost& operator=(const VirtualHost&) = delete;
+
+    /**
+     * @brief Serve files ending in .extension as mime. Overrides the built-in table.
+     */
+    void addMime(std::string extension, std::string mime);
+
+    /**
+     * @brief Only serve static files ending in .extension. As long as none is added, every extension with a known
+     *        MIME is served.
+     */
+    void addFileType(std::string extension);
+
+    // The host pattern this was configured with
+    std::string name;
+    // Serve static files from this directory before handing the request to Drogon. Empty to disable
+    std::string documentRoot;
+    // Prepended to the request path before forwarding to Drogon, so each host can have it's own set of handlers
+    std::string handlerPrefix;
+    // File served when a directory is requested
+    std::string implicitPage = "index.gmi";
+    // File extension (without the dot) to MIME, filled by addMime()
+    std::unordered_map<std::string_view, std::string_view, CaseInsensitiveHash, CaseInsensitiveEqual> mimes;
+    // Extensions static files may have, filled by addFileType()
+    std::unordered_set<std::string_view, CaseInsensitiveHash, CaseInsensitiveEqual> fileTypes;
+    // Storage of the strings mimes and fileTypes point to. deque so they never move
+    std::deque<std::string> strings;
+};
+
+/**
+ * @brief Maps request hosts to virtual hosts. Patterns are either exact host names ("example.com"), wildcards
+ *        matching any subdomain ("*.example.com") or "*" as the fallback. Exact matches win over wildcards and longer
+ *        wildcards win over shorter ones. Matching is case insensitive.
+ *
+ *        All patterns are hashed when added. Lookups only hash slices of the requested host and never copy it. The map
+ *        is read-only once the server starts, so it's safe to share between IO loops.
+ */
+class VirtualHostMap
+{
+public:
+    void add(const std::string& pattern, VirtualHost host);
+    const VirtualHost* find(std::string_view host) const;
+
+    bool empty() const
+    {
+        return hosts_.empty();
+    }
+
+protected:
+    using Map = std::unordered_map<std::string_view, const VirtualHost*, CaseInsensitiveHash, CaseInsensitiveEqual>;
+
+    // deque so pointers into it stay valid as hosts are added
+    std::deque<VirtualHost> hosts_;
+    Map exact_;
+    // Keyed by the part after "*."
+    Map wildcard_;
+    const VirtualHost* default_ = nullptr;
+};
+
+/**
+ * @brief MIME type to serve a static file with, based on it's extension.
+ */
+std::string_view mimeOfFile(const VirtualHost& host, std::string_view path);
+
+/**
+ * @brief If host serves static files of this type. See VirtualHost::addFileType().
+ */
+bool isServedFileType(const VirtualHost& host, std::string_view path);
+
+}